@@ -0,0 +1,250 @@
+/* houseslights - A simple home web server for lighting control
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * loaddriver.c - Generate web traffic to HouseLights, for benchmarking.
+ *
+ * SYNOPSYS:
+ *
+ * This program runs a number of clients in parallel, each issuing
+ * /lights/set and /lights/status requests in a closed loop for the
+ * specified duration. The status requests use the "known" parameter,
+ * the same way the web UI does. The plugs are named bench-1 .. bench-N,
+ * matching the names used by the stub control service.
+ *
+ * Options:
+ *    -server=HOST:PORT     The HouseLights web server (localhost:8080).
+ *    -plugs=N              Number of plugs to control (default: 10).
+ *    -clients=N            Number of parallel clients (default: 4).
+ *    -duration=S           Duration of the test, in seconds (default: 10).
+ *    -set=PERCENT          Share of /lights/set requests (default: 10).
+ *
+ * The result is printed as one line: throughput, error count, and the
+ * response time percentiles (milliseconds) for each type of request.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define MAX_SAMPLES 1000000
+
+typedef struct {
+    int type; // 0: status, 1: set, -1: error.
+    int elapsed; // microseconds.
+} Sample;
+
+static const char *Host = "localhost";
+static const char *Port = "8080";
+static int Plugs = 10;
+static int Clients = 4;
+static int Duration = 10;
+static int SetShare = 10;
+
+static struct addrinfo *Server = 0;
+
+static long long driver_clock (void) {
+    struct timeval now;
+    gettimeofday (&now, 0);
+    return (now.tv_sec * 1000000LL) + now.tv_usec;
+}
+
+// Issue one request and return the HTTP status, or -1 on error.
+// The status line and the latest version are found at the beginning of
+// the response: only the first buffer is kept, and the rest of a large
+// response is read and discarded.
+//
+static int driver_request (const char *uri, unsigned long *latest) {
+
+    static char buffer[65536];
+    static char discard[65536];
+    int size = sizeof(buffer);
+
+    int s = socket (Server->ai_family, Server->ai_socktype, Server->ai_protocol);
+    if (s < 0) return -1;
+    if (connect (s, Server->ai_addr, Server->ai_addrlen) < 0) {
+        close (s);
+        return -1;
+    }
+
+    char request[512];
+    int length = snprintf (request, sizeof(request),
+                           "GET %s HTTP/1.1\r\nHost: %s\r\n"
+                               "Connection: close\r\n\r\n", uri, Host);
+    if (write (s, request, length) != length) {
+        close (s);
+        return -1;
+    }
+
+    int total = 0;
+    for (;;) {
+        int received;
+        if (total < size - 1)
+            received = read (s, buffer + total, size - total - 1);
+        else
+            received = read (s, discard, sizeof(discard));
+        if (received <= 0) break;
+        if (total < size - 1) total += received;
+    }
+    buffer[total] = 0;
+    close (s);
+
+    if (strncmp (buffer, "HTTP/1.", 7)) return -1;
+
+    const char *known = strstr (buffer, "\"latest\":");
+    if (known) *latest = strtoul (known + 9, 0, 10);
+    return atoi (buffer + 9);
+}
+
+static void driver_client (int id, int output) {
+
+    static Sample samples[256]; // A pipe write of this size is atomic.
+    int count = 0;
+    unsigned long known = 0;
+    char uri[256];
+
+    srand (getpid());
+    long long deadline = driver_clock () + (Duration * 1000000LL);
+
+    while (driver_clock () < deadline) {
+        int type = ((rand() % 100) < SetShare);
+        if (type) {
+            snprintf (uri, sizeof(uri),
+                      "/lights/set?device=bench-%d&state=%s&pulse=30&cause=BENCH",
+                      (rand() % Plugs) + 1, (rand() % 2) ? "on" : "off");
+        } else if (known) {
+            snprintf (uri, sizeof(uri), "/lights/status?known=%lu", known);
+        } else {
+            snprintf (uri, sizeof(uri), "/lights/status");
+        }
+        long long start = driver_clock ();
+        int status = driver_request (uri, &known);
+        samples[count].elapsed = (int)(driver_clock () - start);
+        if ((status != 200) && (status != 304)) {
+            samples[count].type = -1;
+        } else {
+            samples[count].type = type;
+        }
+        if (++count >= 256) {
+            write (output, samples, count * sizeof(Sample));
+            count = 0;
+        }
+    }
+    if (count > 0) write (output, samples, count * sizeof(Sample));
+}
+
+static int driver_compare (const void *a, const void *b) {
+    return *((const int *)a) - *((const int *)b);
+}
+
+static void driver_report (const char *name, int *values, int count) {
+
+    if (count <= 0) {
+        printf (" %s=0", name);
+        return;
+    }
+    qsort (values, count, sizeof(int), driver_compare);
+    printf (" %s=%d p50=%.1f p90=%.1f p99=%.1f max=%.1f",
+            name, count,
+            values[count / 2] / 1000.0,
+            values[(count * 9) / 10] / 1000.0,
+            values[(count * 99) / 100] / 1000.0,
+            values[count - 1] / 1000.0);
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strncmp (argv[i], "-server=", 8)) {
+            char *server = strdup (argv[i] + 8);
+            char *colon = strchr (server, ':');
+            if (colon) {
+                *colon = 0;
+                Port = colon + 1;
+            }
+            Host = server;
+        } else if (!strncmp (argv[i], "-plugs=", 7)) {
+            Plugs = atoi (argv[i] + 7);
+        } else if (!strncmp (argv[i], "-clients=", 9)) {
+            Clients = atoi (argv[i] + 9);
+        } else if (!strncmp (argv[i], "-duration=", 10)) {
+            Duration = atoi (argv[i] + 10);
+        } else if (!strncmp (argv[i], "-set=", 5)) {
+            SetShare = atoi (argv[i] + 5);
+        }
+    }
+    if (Plugs <= 0) Plugs = 1;
+    if (Clients <= 0) Clients = 1;
+
+    struct addrinfo hints;
+    memset (&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo (Host, Port, &hints, &Server)) {
+        fprintf (stderr, "Cannot resolve %s:%s\n", Host, Port);
+        return 1;
+    }
+
+    int channel[2];
+    if (pipe (channel) < 0) return 1;
+
+    for (i = 0; i < Clients; ++i) {
+        if (fork() == 0) {
+            close (channel[0]);
+            driver_client (i, channel[1]);
+            exit (0);
+        }
+    }
+    close (channel[1]);
+
+    static int status[MAX_SAMPLES];
+    static int set[MAX_SAMPLES];
+    int statuscount = 0;
+    int setcount = 0;
+    int errors = 0;
+    Sample sample;
+
+    while (read (channel[0], &sample, sizeof(sample)) == sizeof(sample)) {
+        if (sample.type < 0) {
+            errors += 1;
+        } else if (sample.type) {
+            if (setcount < MAX_SAMPLES) set[setcount++] = sample.elapsed;
+        } else {
+            if (statuscount < MAX_SAMPLES) status[statuscount++] = sample.elapsed;
+        }
+    }
+    while (wait (0) > 0) ;
+
+    printf ("requests=%d rps=%.1f errors=%d",
+            statuscount + setcount + errors,
+            (double)(statuscount + setcount + errors) / Duration, errors);
+    driver_report ("status", status, statuscount);
+    driver_report ("set", set, setcount);
+    printf ("\n");
+    return 0;
+}
@@ -0,0 +1,224 @@
+/* houseslights - A simple home web server for lighting control
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * microbench.c - Measure the hot paths of HouseLights in-process.
+ *
+ * SYNOPSYS:
+ *
+ * This program links the plugs and schedule modules with synthetic
+ * provider responses and synthetic plug and schedule tables of growing
+ * size, and measures:
+ * - houselights_plugs_discovery(), the first time (learning the plugs)
+ *   and in steady state (no change);
+ * - houselights_plugs_status() and houselights_schedule_status().
+ *
+ * For each it reports the time per plug (or schedule), the number of
+ * memory allocations per call and the number of bytes produced.
+ *
+ * The plugs module is included as source, so that its static functions
+ * can be called.
+ */
+
+#include <sys/time.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// The memory allocations are counted by wrapping the allocation functions
+// at link time (see the Makefile).
+//
+static long long BenchAllocations = 0;
+
+void *__real_malloc (size_t size);
+void *__real_calloc (size_t count, size_t size);
+void *__real_realloc (void *data, size_t size);
+char *__real_strdup (const char *text);
+
+void *__wrap_malloc (size_t size) {
+    BenchAllocations += 1;
+    return __real_malloc (size);
+}
+
+void *__wrap_calloc (size_t count, size_t size) {
+    BenchAllocations += 1;
+    return __real_calloc (count, size);
+}
+
+void *__wrap_realloc (void *data, size_t size) {
+    BenchAllocations += 1;
+    return __real_realloc (data, size);
+}
+
+char *__wrap_strdup (const char *text) {
+    BenchAllocations += 1;
+    return __real_strdup (text);
+}
+
+#include "../houselights_plugs.c"
+#include "../houselights_schedule.h"
+
+// The functions from houselights.c used by these modules.
+//
+static unsigned long BenchVersion = 0;
+
+void houselights_liveupdate (void) { BenchVersion += 1; }
+unsigned long houselights_livelatest (void) { return BenchVersion; }
+void houselights_configupdate (void) { }
+void houselights_scheduleupdate (void) { }
+
+#define BENCH_MINIMUM 200000000LL // Run each test for at least 0.2 second.
+
+static long long bench_clock (void) {
+    struct timeval now;
+    gettimeofday (&now, 0);
+    return (now.tv_sec * 1000000000LL) + (now.tv_usec * 1000LL);
+}
+
+static void bench_report (const char *name, int size,
+                          long long elapsed, int calls,
+                          long long allocations, long long bytes) {
+    printf ("%-20s %6d %10.1f ns/item %8.2f allocs/call %10lld bytes\n",
+            name, size,
+            (double)elapsed / ((double)calls * size),
+            (double)allocations / calls,
+            bytes);
+}
+
+static char *bench_payload (int size, int on, int *length) {
+
+    int i;
+    LightsOutput payload = {0, 0, 0};
+
+    houselights_output_reset (&payload);
+    houselights_output_format (&payload,
+                               "{\"host\":\"bench\",\"timestamp\":%lld,"
+                                   "\"latest\":%d,\"control\":{\"status\":{",
+                               (long long)time(0), on + 1);
+    for (i = 1; i <= size; ++i) {
+        houselights_output_format (&payload,
+                                   "%s\"bench-%d\":{\"state\":\"%s\","
+                                       "\"mode\":\"output\",\"gear\":\"light\"}",
+                                   (i > 1) ? "," : "", i, on ? "on" : "off");
+    }
+    houselights_output_append (&payload, "}}}");
+    *length = payload.length;
+    return payload.data;
+}
+
+static void bench_discovery (int size) {
+
+    int length;
+    char *payload = bench_payload (size, size & 1, &length);
+    char *data = malloc (length + 1);
+    int calls = 0;
+    long long elapsed = 0;
+
+    BenchAllocations = 0;
+    memcpy (data, payload, length + 1);
+    long long start = bench_clock ();
+    houselights_plugs_discovery ("http://bench", data, length);
+    elapsed = bench_clock () - start;
+    bench_report ("discovery (learn)", size, elapsed, 1, BenchAllocations, length);
+
+    elapsed = 0;
+    BenchAllocations = 0;
+    while (elapsed < BENCH_MINIMUM) {
+        memcpy (data, payload, length + 1);
+        start = bench_clock ();
+        houselights_plugs_discovery ("http://bench", data, length);
+        elapsed += bench_clock () - start;
+        calls += 1;
+    }
+    bench_report ("discovery (steady)", size, elapsed, calls,
+                  BenchAllocations, length);
+    free (data);
+    free (payload);
+}
+
+static void bench_plugs_status (int size) {
+
+    static LightsOutput out;
+    int calls = 0;
+    long long elapsed = 0;
+
+    houselights_output_reset (&out); // Warm up.
+    houselights_plugs_status (&out);
+
+    BenchAllocations = 0;
+    while (elapsed < BENCH_MINIMUM) {
+        long long start = bench_clock ();
+        houselights_output_reset (&out);
+        houselights_plugs_status (&out);
+        elapsed += bench_clock () - start;
+        calls += 1;
+    }
+    bench_report ("plugs status", size, elapsed, calls,
+                  BenchAllocations, out.length);
+}
+
+static void bench_schedule_status (int size) {
+
+    static LightsOutput out;
+    static int added = 0;
+    char name[32];
+    int calls = 0;
+    long long elapsed = 0;
+
+    while (added < size) {
+        snprintf (name, sizeof(name), "bench-%d", ++added);
+        houselights_schedule_add (name, "+00:10", "23:00", 0x7f);
+    }
+    houselights_output_reset (&out); // Warm up.
+    houselights_schedule_status (&out);
+
+    // Count the schedules listed, for the report.
+    int count = 0;
+    const char *cursor = out.data;
+    while ((cursor = strstr (cursor, "{\"id\":")) != 0) {
+        count += 1;
+        cursor += 6;
+    }
+    if (count <= 0) return;
+
+    BenchAllocations = 0;
+    while (elapsed < BENCH_MINIMUM) {
+        long long start = bench_clock ();
+        houselights_output_reset (&out);
+        houselights_schedule_status (&out);
+        elapsed += bench_clock () - start;
+        calls += 1;
+    }
+    bench_report ("schedule status", count, elapsed, calls,
+                  BenchAllocations, out.length);
+}
+
+int main (int argc, const char **argv) {
+
+    static const int sizes[] = {10, 100, 1000, 10000};
+    int i;
+
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+        bench_discovery (sizes[i]);
+        bench_plugs_status (sizes[i]);
+        bench_schedule_status (sizes[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+#!/bin/sh
+#
+# HouseLights - a simple web server to control lights.
+#
+# Copyright 2025, Pascal Martin
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor,
+# Boston, MA  02110-1301, USA.
+#
+# Run the HouseLights load benchmark on loopback, for each combination
+# of plug count and stub provider count. This requires houseportal to
+# be running on this machine, since the stub providers are discovered
+# through it. Run from the top of the source tree, after make.
+#
+# The following environment variables change the test matrix:
+#   PLUGS      List of plug counts (default: 10 100 1000 10000).
+#   PROVIDERS  List of stub provider counts (default: 1 10 100).
+#   DURATION   Duration of each load test in seconds (default: 20).
+#   CLIENTS    Number of parallel web clients (default: 4).
+#   LATENCY    Response delay of each stub in milliseconds (default: 0).
+#   FAILURE    Percentage of controls failed by the stubs (default: 0).
+#   PORT       The HouseLights web port (default: 8080).
+
+PLUGS=${PLUGS:-10 100 1000 10000}
+PROVIDERS=${PROVIDERS:-1 10 100}
+DURATION=${DURATION:-20}
+CLIENTS=${CLIENTS:-4}
+LATENCY=${LATENCY:-0}
+FAILURE=${FAILURE:-0}
+PORT=${PORT:-8080}
+
+SERVER=localhost:$PORT
+PIDS=
+
+cleanup () {
+    if [ "x$PIDS" != "x" ] ; then kill $PIDS 2>/dev/null ; wait 2>/dev/null ; fi
+    PIDS=
+}
+trap cleanup EXIT INT TERM
+
+# Return the CPU time (user + system, in clock ticks) used by a process.
+cputime () {
+    awk '{print $14 + $15}' /proc/$1/stat
+}
+
+rss () {
+    awk '/^VmRSS:/ {print $2}' /proc/$1/status
+}
+
+for plugs in $PLUGS ; do
+    for providers in $PROVIDERS ; do
+        if [ $providers -gt $plugs ] ; then continue ; fi
+
+        points=$((plugs / providers))
+        i=0
+        while [ $i -lt $providers ] ; do
+            ./bench/stubprovider -prefix=/stub$i -points=$points \
+                                 -first=$((i * points + 1)) \
+                                 -latency=$LATENCY -failure=$FAILURE -batch &
+            PIDS="$PIDS $!"
+            i=$((i + 1))
+        done
+
+        ./houselights -http-service=$PORT >/dev/null 2>&1 &
+        lights=$!
+        PIDS="$PIDS $lights"
+
+        # Wait until all the stubs have been discovered.
+        tries=0
+        while [ $tries -lt 60 ] ; do
+            sleep 1
+            found=`curl -s http://$SERVER/lights/providers | grep -o '"url":' | wc -l`
+            if [ $found -ge $providers ] ; then break ; fi
+            tries=$((tries + 1))
+        done
+
+        cpu=`cputime $lights`
+        result=`./bench/loaddriver -server=$SERVER -plugs=$plugs -clients=$CLIENTS -duration=$DURATION`
+        cpu=$(( `cputime $lights` - cpu ))
+        ticks=`getconf CLK_TCK`
+
+        echo "plugs=$plugs providers=$providers $result cpu=$((cpu * 100 / (ticks * DURATION)))% rss=`rss $lights`kB"
+        echo "  latency: `curl -s http://$SERVER/lights/latency | grep -o '"MANUAL":{[^}]*}[^}]*}[^}]*}'`"
+
+        cleanup
+    done
+done
@@ -0,0 +1,275 @@
+/* houseslights - A simple home web server for lighting control
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * stubprovider.c - A stub control service, for benchmarking HouseLights.
+ *
+ * SYNOPSYS:
+ *
+ * This program implements the subset of the control web API that
+ * HouseLights uses: GET /status (with the ?known= poll for changes),
+ * GET /set?point=&state=&pulse=&cause= and the batch POST /set. The
+ * points are simulated: each control changes the state immediately,
+ * and the pulse is applied when it expires.
+ *
+ * The service declares itself to the local HousePortal as a "control"
+ * service, so that HouseLights discovers it as any real one.
+ *
+ * Options:
+ *    -prefix=/stub         The root of this service's URIs.
+ *    -points=N             Number of points, named bench-F .. bench-(F+N-1)
+ *    -first=F              Number of the first point (default: 1).
+ *    -latency=MS           Delay each response by MS milliseconds.
+ *    -failure=PERCENT      Fail this percentage of the controls (HTTP 500).
+ *    -batch                Declare support for batch controls.
+ *
+ * The latency is a blocking delay: a stub serializes its requests, the
+ * same way a slow device would. Run more stubs for more concurrency.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <echttp.h>
+#include <echttp_json.h>
+
+#include "houseportalclient.h"
+#include "housestate.h"
+
+#include "../houselights_output.h"
+
+typedef struct {
+    char state;      // 0: off, 1: on.
+    time_t deadline; // End of the pulse, 0 if none.
+} StubPoint;
+
+static StubPoint *Points = 0;
+static int PointsCount = 100;
+static int PointsFirst = 1;
+
+static const char *Prefix = "/stub";
+static int Latency = 0;
+static int Failure = 0;
+static int Batch = 0;
+
+static int LiveState = -1;
+static char HostName[256];
+
+static LightsOutput Output;
+
+static void stub_delay (void) {
+    if (Latency > 0) usleep (Latency * 1000);
+}
+
+static int stub_point (const char *name) {
+    if (!name) return -1;
+    if (strncmp (name, "bench-", 6)) return -1;
+    int index = atoi (name + 6) - PointsFirst;
+    if ((index < 0) || (index >= PointsCount)) return -1;
+    return index;
+}
+
+static const char *stub_status (const char *method, const char *uri,
+                                const char *data, int length) {
+
+    int i;
+    const char *prefix = "";
+
+    stub_delay ();
+    if (housestate_same (LiveState)) return "";
+
+    houselights_output_reset (&Output);
+    houselights_output_format (&Output,
+                               "{\"host\":\"%s\",\"timestamp\":%lld,"
+                                   "\"latest\":%lu,\"control\":{\"batch\":%s,"
+                                   "\"status\":{",
+                               HostName, (long long)time(0),
+                               housestate_current (LiveState),
+                               Batch ? "true" : "false");
+    for (i = 0; i < PointsCount; ++i) {
+        houselights_output_format (&Output,
+                                   "%s\"bench-%d\":{\"state\":\"%s\","
+                                       "\"mode\":\"output\",\"gear\":\"light\"}",
+                                   prefix, i + PointsFirst,
+                                   Points[i].state ? "on" : "off");
+        prefix = ",";
+    }
+    houselights_output_append (&Output, "}}}");
+    echttp_content_type_json ();
+    return Output.data;
+}
+
+static int stub_control (const char *point, const char *state, int pulse) {
+
+    int index = stub_point (point);
+    if (index < 0) return 404;
+    if (!state) return 400;
+
+    if (Failure && ((rand() % 100) < Failure)) return 500;
+
+    char value = (strcmp (state, "on") == 0);
+    Points[index].deadline = (pulse > 0) ? time(0) + pulse : 0;
+    if (Points[index].state != value) {
+        Points[index].state = value;
+        housestate_changed (LiveState);
+    }
+    return 200;
+}
+
+static int stub_batch (const char *data, int length) {
+
+    int i;
+    int status = 200;
+
+    char *json = malloc (length + 1);
+    memcpy (json, data, length);
+    json[length] = 0;
+
+    int count = echttp_json_estimate (json);
+    if (count <= 0) {
+        free (json);
+        return 400;
+    }
+    ParserToken *tokens = calloc (count, sizeof(ParserToken));
+    if (echttp_json_parse (json, tokens, &count)) {
+        status = 400;
+    } else {
+        int controls = echttp_json_search (tokens, ".controls");
+        if ((controls < 0) || (tokens[controls].type != PARSER_ARRAY)) {
+            status = 400;
+        } else {
+            int n = tokens[controls].length;
+            int *list = calloc (n, sizeof(int));
+            echttp_json_enumerate (tokens + controls, list, n);
+            for (i = 0; i < n; ++i) {
+                ParserToken *item = tokens + controls + list[i];
+                int point = echttp_json_search (item, ".point");
+                int state = echttp_json_search (item, ".state");
+                int pulse = echttp_json_search (item, ".pulse");
+                if ((point < 0) || (state < 0)) continue;
+                int result = stub_control (item[point].value.string,
+                                           item[state].value.string,
+                                           (pulse < 0) ? 0 :
+                                              (int)(item[pulse].value.integer));
+                if (result != 200) status = result;
+            }
+            free (list);
+        }
+    }
+    free (tokens);
+    free (json);
+    return status;
+}
+
+static const char *stub_set (const char *method, const char *uri,
+                             const char *data, int length) {
+
+    int status;
+
+    if (!strcmp (method, "POST")) {
+        if (!Batch) {
+            stub_delay ();
+            echttp_error (405, "batch controls not supported");
+            return "";
+        }
+        status = stub_batch (data, length);
+    } else {
+        const char *pulse = echttp_parameter_get ("pulse");
+        status = stub_control (echttp_parameter_get ("point"),
+                               echttp_parameter_get ("state"),
+                               pulse ? atoi(pulse) : 0);
+    }
+    if (status != 200) {
+        stub_delay ();
+        echttp_error (status, "control failed");
+        return "";
+    }
+    return stub_status (method, uri, data, length);
+}
+
+static void stub_background (int fd, int mode) {
+
+    static time_t last = 0;
+    time_t now = time(0);
+    int i;
+
+    if (now == last) return;
+    last = now;
+
+    for (i = 0; i < PointsCount; ++i) {
+        if (Points[i].deadline && (Points[i].deadline <= now)) {
+            Points[i].deadline = 0;
+            if (Points[i].state) {
+                Points[i].state = 0;
+                housestate_changed (LiveState);
+            }
+        }
+    }
+    houseportal_background (now);
+}
+
+int main (int argc, const char **argv) {
+
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strncmp (argv[i], "-prefix=", 8)) {
+            Prefix = argv[i] + 8;
+        } else if (!strncmp (argv[i], "-points=", 8)) {
+            PointsCount = atoi (argv[i] + 8);
+        } else if (!strncmp (argv[i], "-first=", 7)) {
+            PointsFirst = atoi (argv[i] + 7);
+        } else if (!strncmp (argv[i], "-latency=", 9)) {
+            Latency = atoi (argv[i] + 9);
+        } else if (!strncmp (argv[i], "-failure=", 9)) {
+            Failure = atoi (argv[i] + 9);
+        } else if (!strcmp (argv[i], "-batch")) {
+            Batch = 1;
+        }
+    }
+    if (PointsCount <= 0) PointsCount = 1;
+    Points = calloc (PointsCount, sizeof(StubPoint));
+
+    gethostname (HostName, sizeof(HostName));
+
+    echttp_default ("-http-service=dynamic");
+    argc = echttp_open (argc, argv);
+
+    static char declaration[256];
+    snprintf (declaration, sizeof(declaration), "control:%s", Prefix);
+    const char *path[] = {declaration};
+    houseportal_initialize (argc, argv);
+    houseportal_declare (echttp_port(4), path, 1);
+
+    LiveState = housestate_declare ("live");
+
+    static char status[256];
+    static char set[256];
+    snprintf (status, sizeof(status), "%s/status", Prefix);
+    snprintf (set, sizeof(set), "%s/set", Prefix);
+    echttp_route_uri (status, stub_status);
+    echttp_route_uri (set, stub_set);
+
+    echttp_background (&stub_background);
+    echttp_loop();
+    return 0;
+}
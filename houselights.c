@@ -35,6 +35,8 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <zlib.h>
+
 #include "echttp.h"
 #include "echttp_cors.h"
 #include "echttp_static.h"
@@ -48,29 +50,272 @@
 #include "housealmanac.h"
 
 #include "houselights.h"
+#include "houselights_output.h"
+#include "houselights_metrics.h"
 #include "houselights_plugs.h"
 #include "houselights_schedule.h"
+#include "houselights_scene.h"
 #include "houselights_template.h"
 
 static int LiveState = -1;
 static int ConfigState = -1;
 
+// The status and schedule documents are generated once for each version
+// of the matching state and shared by all clients. The timestamp is
+// refreshed in place when a cached document is reused. The almanac data
+// does not change the live state, so the status is regenerated
+// periodically to pick up any almanac update.
+//
+// Each generated document is identified by an ETag built from the state
+// version and the generation time, so that standard HTTP clients and
+// caches can revalidate it using If-None-Match. This is a weak ETag: the
+// timestamp in the body changes when a cached document is reused, but the
+// content is otherwise the same. If-None-Match uses the weak comparison,
+// so the tag matches with or without the W/ prefix.
+//
+// A document is compressed at most once, the first time a client that
+// accepts gzip requests it. The compressed form keeps the timestamp of
+// its generation.
+//
+typedef struct {
+    int valid;
+    unsigned long version;
+    time_t generated;
+    int maxage;
+    int timestamp; // Offset of the timestamp in the document.
+    int digits;    // Length of the timestamp in the document.
+    LightsOutput output;
+    int compressed;
+    LightsOutput gzip;
+} LightsCache;
+
+static LightsCache StatusCache = {.maxage = 60};
+static LightsCache ScheduleCache = {.maxage = 0};
+
+#define LIGHTS_ALMANAC_SIZE 1024
+
+#define LIGHTS_GZIP_MIN 1024 // Not worth compressing smaller documents.
+
+static long long LightsNotModified = 0;
+static long long LightsCompressions = 0;
+static long long LightsCompressed = 0;   // Responses sent compressed.
+static long long LightsGzipIn = 0;       // Bytes before compression.
+static long long LightsGzipOut = 0;      // Bytes after compression.
+
+// The schedule changes are saved to the configuration in the background,
+// once no change was made for LIGHTS_SAVE_QUIET seconds. A long burst of
+// changes is still saved every LIGHTS_SAVE_DELAY seconds, or as soon as
+// LIGHTS_SAVE_BURST changes are pending. Any pending change is saved
+// before the service stops.
+//
+#define LIGHTS_SAVE_QUIET   2
+#define LIGHTS_SAVE_DELAY  10
+#define LIGHTS_SAVE_BURST 100
+
+static int         ConfigPending = 0; // Number of changes not yet saved.
+static const char *ConfigReason = 0;
+static time_t      ConfigFirstChange = 0;
+static time_t      ConfigLastChange = 0;
+static long long   ConfigSaves = 0;
+static long long   ConfigChanges = 0;
+
+static volatile int LightsStopping = 0;
+
+// Metrics for the generation of each type of response: how often the
+// cached document was reused, and the time (microseconds) and size
+// (bytes) of the documents actually generated.
+//
+typedef struct {
+    long long hits;
+    LightsHistogram time;
+    LightsHistogram size;
+} LightsMetrics;
+
+static LightsMetrics StatusMetrics =
+    {0, LIGHTS_HISTOGRAM(10), LIGHTS_HISTOGRAM(1024)};
+static LightsMetrics DeltaMetrics =
+    {0, LIGHTS_HISTOGRAM(10), LIGHTS_HISTOGRAM(1024)};
+static LightsMetrics ScheduleMetrics =
+    {0, LIGHTS_HISTOGRAM(10), LIGHTS_HISTOGRAM(1024)};
+
 
 void houselights_liveupdate (void) {
     housestate_changed (LiveState);
+    StatusCache.valid = 0;
+}
+
+unsigned long houselights_livelatest (void) {
+    return housestate_current (LiveState);
 }
 
 void houselights_configupdate(void) {
     housestate_changed (ConfigState);
+    ScheduleCache.valid = 0;
+    StatusCache.valid = 0; // Config changes cascade to the live state.
+}
+
+void houselights_scheduleupdate(void) {
+    ScheduleCache.valid = 0; // The state of a schedule changed, not its config.
+}
+
+static const char *lights_cached (LightsCache *cache, int state) {
+
+    if (!cache->valid) return 0;
+    if (cache->version != housestate_current (state)) return 0;
+
+    time_t now = time(0);
+    if (cache->maxage && (now >= cache->generated + cache->maxage)) return 0;
+
+    char ascii[24];
+    int digits = snprintf (ascii, sizeof(ascii), "%lld", (long long)now);
+    if (digits != cache->digits) return 0;
+    memcpy (cache->output.data + cache->timestamp, ascii, digits);
+    return cache->output.data;
+}
+
+static LightsOutput *lights_header (LightsCache *cache, int state) {
+
+    LightsOutput *out = &(cache->output);
+    time_t now = time(0);
+
+    cache->valid = 0;
+    cache->compressed = 0;
+    cache->version = housestate_current (state);
+    cache->generated = now;
+
+    houselights_output_reset (out);
+    houselights_output_format (out,
+                               "{\"host\":\"%s\",\"proxy\":\"%s\",\"timestamp\":",
+                               houselog_host(), houseportal_server());
+    cache->timestamp = out->length;
+    houselights_output_format (out, "%lld", (long long)now);
+    cache->digits = out->length - cache->timestamp;
+    houselights_output_format (out,
+                               ",\"lights\":{\"latest\":%lu,", cache->version);
+    return out;
+}
+
+static int lights_compress (LightsCache *cache) {
+
+    LightsOutput *in = &(cache->output);
+    LightsOutput *out = &(cache->gzip);
+    z_stream stream;
+
+    memset (&stream, 0, sizeof(stream));
+    if (deflateInit2 (&stream, Z_DEFAULT_COMPRESSION,
+                      Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0; // The +16 selects the gzip format.
+
+    int size = deflateBound (&stream, in->length);
+    houselights_output_reset (out);
+    stream.next_in = (Bytef *)(in->data);
+    stream.avail_in = in->length;
+    stream.next_out = (Bytef *)houselights_output_reserve (out, size);
+    stream.avail_out = size;
+
+    int status = deflate (&stream, Z_FINISH);
+    deflateEnd (&stream);
+    if (status != Z_STREAM_END) return 0;
+
+    houselights_output_commit (out, size - stream.avail_out);
+    LightsCompressions += 1;
+    return 1;
 }
 
-static int lights_header (char *buffer, int size, int state) {
+static void lights_etag (const LightsCache *cache, int gzip,
+                         char *etag, int size) {
+    snprintf (etag, size, "W/\"%lu-%lld%s\"",
+              cache->version, (long long)(cache->generated), gzip?"-gz":"");
+}
+
+// Return the cached document in the form the client accepts, or an empty
+// response with a 304 status if the client has the same document. The
+// document is compressed only when it is actually sent.
+//
+static const char *lights_send (LightsCache *cache) {
+
+    const char *encoding = echttp_attribute_get ("Accept-Encoding");
+    int gzip = encoding && strstr (encoding, "gzip") &&
+               (cache->output.length >= LIGHTS_GZIP_MIN);
+
+    char etag[64];
+    lights_etag (cache, gzip, etag, sizeof(etag));
+    echttp_attribute_set ("Vary", "Accept-Encoding");
+
+    const char *match = echttp_attribute_get ("If-None-Match");
+    if (match && strstr (match, etag+2)) {
+        echttp_attribute_set ("ETag", etag);
+        LightsNotModified += 1;
+        echttp_error (304, "Not Modified");
+        return "";
+    }
 
-    return snprintf (buffer, size,
-                     "{\"host\":\"%s\",\"proxy\":\"%s\","
-                          "\"timestamp\":%lld,\"lights\":{\"latest\":%lu,",
-                     houselog_host(), houseportal_server(),
-                     (long long)time(0), housestate_current (state));
+    if (gzip && (!cache->compressed)) {
+        cache->compressed = lights_compress (cache);
+        if (!cache->compressed) {
+            gzip = 0;
+            lights_etag (cache, gzip, etag, sizeof(etag));
+        }
+    }
+    echttp_attribute_set ("ETag", etag);
+
+    if (gzip) {
+        LightsCompressed += 1;
+        LightsGzipIn += cache->output.length;
+        LightsGzipOut += cache->gzip.length;
+        echttp_attribute_set ("Content-Encoding", "gzip");
+        echttp_content_length (cache->gzip.length);
+        return cache->gzip.data;
+    }
+    return cache->output.data;
+}
+
+static void lights_measured (LightsMetrics *metrics,
+                             long long start, const LightsOutput *out) {
+    houselights_metrics_record
+        (&(metrics->time), houselights_metrics_clock() - start);
+    houselights_metrics_record (&(metrics->size), out->length);
+}
+
+static void lights_almanac (LightsOutput *out) {
+    char *buffer = houselights_output_reserve (out, LIGHTS_ALMANAC_SIZE);
+    houselights_output_commit
+        (out, housealmanac_status (buffer, LIGHTS_ALMANAC_SIZE));
+}
+
+static const char *lights_delta (unsigned long known) {
+
+    // The delta depends on the client, so it is never served again: only
+    // its (growable) buffer is reused from one request to the next.
+    //
+    static LightsCache delta;
+    long long start = houselights_metrics_clock ();
+    LightsOutput *out = lights_header (&delta, LiveState);
+
+    if (houselights_plugs_delta (out, known) < 0)
+        return 0; // Too far behind, or too large: use a full status.
+    lights_almanac (out);
+    houselights_output_append (out, "}}");
+    lights_measured (&DeltaMetrics, start, out);
+    return out->data;
+}
+
+static const char *lights_status_document (void) {
+
+    const char *cached = lights_cached (&StatusCache, LiveState);
+    if (cached) {
+        StatusMetrics.hits += 1;
+        return cached;
+    }
+
+    long long start = houselights_metrics_clock ();
+    LightsOutput *out = lights_header (&StatusCache, LiveState);
+    houselights_plugs_status (out);
+    lights_almanac (out);
+    houselights_output_append (out, "}}");
+    StatusCache.valid = 1;
+    lights_measured (&StatusMetrics, start, out);
+    return out->data;
 }
 
 static const char *lights_status (const char *method, const char *uri,
@@ -78,14 +323,59 @@ static const char *lights_status (const char *method, const char *uri,
 
     if (housestate_same (LiveState)) return "";
 
-    static char buffer[65537];
-    int cursor = lights_header (buffer, sizeof(buffer), LiveState);
+    echttp_content_type_json ();
+
+    const char *known = echttp_parameter_get ("known");
+    if (known && echttp_parameter_get ("delta")) {
+        const char *delta = lights_delta (strtoul (known, 0, 10));
+        if (delta) return delta;
+    }
 
-    cursor += houselights_plugs_status (buffer+cursor, sizeof(buffer)-cursor);
-    cursor += housealmanac_status (buffer+cursor, sizeof(buffer)-cursor);
-    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, "}}");
+    lights_status_document ();
+    return lights_send (&StatusCache);
+}
+
+static const char *lights_providers (const char *method, const char *uri,
+                                     const char *data, int length) {
+
+    static LightsCache providers; // Never reused: counters change.
+    LightsOutput *out = lights_header (&providers, LiveState);
+
+    houselights_plugs_providers (out);
+    houselights_output_append (out, "}}");
     echttp_content_type_json ();
-    return buffer;
+    return out->data;
+}
+
+static const char *lights_latency (const char *method, const char *uri,
+                                   const char *data, int length) {
+
+    static LightsCache latency; // Never reused: statistics change.
+    LightsOutput *out = lights_header (&latency, LiveState);
+
+    houselights_plugs_latency (out);
+    houselights_output_append (out, "}}");
+    echttp_content_type_json ();
+    return out->data;
+}
+
+static const char *lights_schedule_document (void) {
+
+    const char *cached = lights_cached (&ScheduleCache, ConfigState);
+    if (cached) {
+        ScheduleMetrics.hits += 1;
+        return cached;
+    }
+
+    long long start = houselights_metrics_clock ();
+    LightsOutput *out = lights_header (&ScheduleCache, ConfigState);
+    houselights_schedule_status (out);
+    houselights_output_append (out, ",");
+    houselights_scene_status (out);
+    houselights_output_append (out, "}}");
+    ScheduleCache.valid = 1;
+    lights_measured (&ScheduleMetrics, start, out);
+    return out->data;
 }
 
 static const char *lights_schedule (const char *method, const char *uri,
@@ -93,13 +383,74 @@ static const char *lights_schedule (const char *method, const char *uri,
 
     if (housestate_same (ConfigState)) return "";
 
-    static char buffer[65537];
-    int cursor = lights_header (buffer, sizeof(buffer), ConfigState);
+    echttp_content_type_json ();
+    lights_schedule_document ();
+    return lights_send (&ScheduleCache);
+}
+
+static const char *lights_timeline (const char *method, const char *uri,
+                                    const char *data, int length) {
+
+    static LightsCache timeline; // The schedule module keeps the timeline.
+    const char *days = echttp_parameter_get ("days");
+    LightsOutput *out = lights_header (&timeline, ConfigState);
+
+    houselights_schedule_timeline (out, days ? atoi(days) : 1, time(0));
+    houselights_output_append (out, "}}");
+    echttp_content_type_json ();
+    return out->data;
+}
+
+static void lights_metrics_format (LightsOutput *out,
+                                   const char *name, LightsMetrics *metrics) {
+    houselights_output_format (out, "\"%s\":{\"hits\":%lld,",
+                               name, metrics->hits);
+    houselights_metrics_format (out, "time", &(metrics->time));
+    houselights_output_append (out, ",");
+    houselights_metrics_format (out, "size", &(metrics->size));
+    houselights_output_append (out, "},");
+}
+
+static const char *lights_metrics (const char *method, const char *uri,
+                                   const char *data, int length) {
 
-    cursor += houselights_schedule_status (buffer+cursor, sizeof(buffer)-cursor);
-    cursor += snprintf (buffer+cursor, sizeof(buffer)-cursor, "}}");
+    static LightsCache metrics; // Never reused: counters change.
+    LightsOutput *out = lights_header (&metrics, LiveState);
+
+    houselights_output_append (out, "\"metrics\":{");
+    lights_metrics_format (out, "status", &StatusMetrics);
+    lights_metrics_format (out, "delta", &DeltaMetrics);
+    lights_metrics_format (out, "schedule", &ScheduleMetrics);
+    houselights_plugs_metrics (out);
+    houselights_output_append (out, ",");
+    houselights_schedule_metrics (out);
+    houselights_output_append (out, ",");
+    houselights_output_metrics (out);
+    houselights_output_format (out,
+                               ",\"http\":{\"notmodified\":%lld,"
+                                   "\"compressions\":%lld,\"compressed\":%lld,"
+                                   "\"gzipin\":%lld,\"gzipout\":%lld}",
+                               LightsNotModified, LightsCompressions,
+                               LightsCompressed, LightsGzipIn, LightsGzipOut);
+    houselights_output_format (out,
+                               ",\"config\":{\"changes\":%lld,\"saves\":%lld,"
+                                   "\"pending\":%d}",
+                               ConfigChanges, ConfigSaves, ConfigPending);
+    houselights_output_append (out, "}}}");
     echttp_content_type_json ();
-    return buffer;
+    return out->data;
+}
+
+static const char *lights_scenes (const char *method, const char *uri,
+                                  const char *data, int length) {
+
+    static LightsCache scenes; // Never reused: the progress changes.
+    LightsOutput *out = lights_header (&scenes, LiveState);
+
+    houselights_scene_progress (out);
+    houselights_output_append (out, "}}");
+    echttp_content_type_json ();
+    return out->data;
 }
 
 static const char *lights_set (const char *method, const char *uri,
@@ -109,6 +460,39 @@ static const char *lights_set (const char *method, const char *uri,
     const char *state = echttp_parameter_get("state");
     const char *pulsep = echttp_parameter_get("pulse");
     const char *cause = echttp_parameter_get("cause");
+    const char *scene = echttp_parameter_get("scene");
+    const char *group = echttp_parameter_get("group");
+
+    if (scene) {
+        if (houselights_scene_apply (scene, cause) < 0) {
+            echttp_error (404, "unknown scene");
+            return "";
+        }
+        houselights_liveupdate ();
+        return lights_scenes (method, uri, data, length);
+    }
+    if (group) {
+        if (!state) {
+            echttp_error (400, "missing state value");
+            return "";
+        }
+        if (strcmp (state, "on") && strcmp (state, "off")) {
+            echttp_error (400, "invalid state value");
+            return "";
+        }
+        int pulse = pulsep ? atoi(pulsep) : 0;
+        if (pulse < 0) {
+            echttp_error (400, "invalid pulse value");
+            return "";
+        }
+        if (houselights_scene_group (group, state, pulse, cause) < 0) {
+            echttp_error (404, "unknown group");
+            return "";
+        }
+        houselights_liveupdate ();
+        echttp_content_type_json ();
+        return lights_status_document (); // A control is never conditional.
+    }
 
     if (!name) {
         echttp_error (404, "missing device name");
@@ -131,17 +515,48 @@ static const char *lights_set (const char *method, const char *uri,
     } else {
         houselights_plugs_set (name, state, 0, 1, cause);
     }
-    housestate_changed (LiveState);
-    return lights_status (method, uri, data, length);
+    houselights_plugs_flush ();
+    houselights_liveupdate ();
+    echttp_content_type_json ();
+    return lights_status_document ();
+}
+
+static void lights_persist (time_t now, int force) {
+
+    if (!ConfigPending) return;
+
+    if (!force) {
+        if ((now < ConfigLastChange + LIGHTS_SAVE_QUIET) &&
+            (now < ConfigFirstChange + LIGHTS_SAVE_DELAY) &&
+            (ConfigPending < LIGHTS_SAVE_BURST)) return;
+    }
+
+    char reason[64];
+    if (ConfigPending == 1) {
+        snprintf (reason, sizeof(reason), "%s", ConfigReason);
+    } else {
+        snprintf (reason, sizeof(reason), "%d SCHEDULE CHANGES", ConfigPending);
+    }
+    if (echttp_isdebug()) printf ("Saving the configuration: %s\n", reason);
+    houseconfig_save (lights_schedule_document (), reason);
+    ConfigSaves += 1;
+    ConfigPending = 0;
 }
 
 static const char *lights_save (const char *method, const char *uri,
                                 const char *data, int length, const char *reason) {
-    const char *text = lights_schedule (method, uri, data, length);
-    houseconfig_save (text, reason);
-    housestate_changed (ConfigState);
+
+    time_t now = time(0);
+
+    houselights_configupdate ();
+    if (!ConfigPending) ConfigFirstChange = now;
+    ConfigLastChange = now;
+    ConfigReason = reason;
+    ConfigPending += 1;
+    ConfigChanges += 1;
+
     echttp_content_type_json ();
-    return text;
+    return lights_schedule_document ();
 }
 
 static const char *lights_enable (const char *method, const char *uri,
@@ -184,6 +599,26 @@ static const char *lights_delete (const char *method, const char *uri,
     return lights_save (method, uri, data, length, "SCHEDULE RULE DELETED");
 }
 
+static const char *lights_bulk (const char *method, const char *uri,
+                                const char *data, int length) {
+
+    if (strcmp (method, "POST")) {
+        echttp_error (405, "POST only");
+        return "";
+    }
+    const char *action = echttp_parameter_get("action");
+    const char *error = houselights_schedule_bulk (action, data);
+    if (error) {
+        echttp_error (400, error);
+        return "";
+    }
+    if (action && !strcmp (action, "delete"))
+        return lights_save (method, uri, data, length, "SCHEDULE RULES DELETED");
+
+    housediscover (0);
+    return lights_save (method, uri, data, length, "SCHEDULE RULES IMPORTED");
+}
+
 static void lights_background (int fd, int mode) {
 
     time_t now = time(0);
@@ -191,6 +626,13 @@ static void lights_background (int fd, int mode) {
     houseportal_background (now);
     houselights_plugs_periodic(now);
     houselights_schedule_periodic(now);
+    houselights_plugs_flush ();
+    lights_persist (now, LightsStopping);
+    if (LightsStopping) {
+        houselog_event ("SERVICE", "lights", "STOPPED", "ON %s", houselog_host());
+        houselog_background (now);
+        exit (0);
+    }
     housediscover (now);
     housealmanac_background (now);
     houselog_background (now);
@@ -198,8 +640,15 @@ static void lights_background (int fd, int mode) {
     housedepositor_periodic (now);
 }
 
+static void lights_stop (int sig) {
+    LightsStopping = 1; // Finish in the background, outside of the signal.
+}
+
 static const char *lights_refresh (void) {
-    housestate_changed (ConfigState);
+    ConfigPending = 0; // A new configuration replaces any pending change.
+    houselights_configupdate ();
+    const char *error = houselights_scene_refresh ();
+    if (error) return error;
     return houselights_schedule_refresh ();
 }
 
@@ -219,6 +668,8 @@ int main (int argc, const char **argv) {
     dup(open ("/dev/null", O_WRONLY));
 
     signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, lights_stop);
+    signal(SIGINT, lights_stop);
 
     echttp_default ("-http-service=dynamic");
 
@@ -249,11 +700,17 @@ int main (int argc, const char **argv) {
 
     echttp_route_uri ("/lights/schedule", lights_schedule);
     echttp_route_uri ("/lights/status", lights_status);
+    echttp_route_uri ("/lights/timeline", lights_timeline);
+    echttp_route_uri ("/lights/providers", lights_providers);
+    echttp_route_uri ("/lights/metrics", lights_metrics);
+    echttp_route_uri ("/lights/latency", lights_latency);
     echttp_route_uri ("/lights/set",    lights_set);
+    echttp_route_uri ("/lights/scenes", lights_scenes);
     echttp_route_uri ("/lights/enable", lights_enable);
     echttp_route_uri ("/lights/disable",lights_disable);
     echttp_route_uri ("/lights/add",    lights_add);
     echttp_route_uri ("/lights/delete", lights_delete);
+    echttp_route_uri ("/lights/schedules", lights_bulk);
 
     echttp_static_route ("/", "/usr/local/share/house/public");
     echttp_background (&lights_background);
@@ -22,5 +22,7 @@
  */
 
 void houselights_liveupdate (void);
+unsigned long houselights_livelatest (void);
 void houselights_configupdate (void);
+void houselights_scheduleupdate (void);
 
@@ -0,0 +1,116 @@
+/* houseslights - A simple home web server for lighting control
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * houselights_metrics.c - Counters and histograms for runtime metrics.
+ *
+ * SYNOPSYS:
+ *
+ * This module provides fixed-bucket histograms that are cheap enough to
+ * be always active: recording a value is a few integer operations, and
+ * does not allocate memory. The bucket bounds grow by a factor of 4,
+ * starting from the histogram's scale. The last bucket counts all the
+ * values above the last bound.
+ *
+ * The counters themselves are owned by each module, which reports them
+ * in its own section of the metrics response.
+ *
+ * long long houselights_metrics_clock (void);
+ *
+ *    Return the current time in microseconds, for measuring durations.
+ *
+ * void houselights_metrics_record (LightsHistogram *h, long long value);
+ *
+ *    Account for one value in the specified histogram.
+ *
+ * long long houselights_metrics_percentile (const LightsHistogram *h,
+ *                                           int percent);
+ *
+ *    Return an estimate of the specified percentile: the upper bound of
+ *    the bucket where it falls, or the maximum value if lower.
+ *
+ * void houselights_metrics_format (LightsOutput *out,
+ *                                  const char *name, const LightsHistogram *h);
+ *
+ *    Append the JSON representation of one histogram, as a named item.
+ */
+
+#include <sys/time.h>
+
+#include "houselights_output.h"
+#include "houselights_metrics.h"
+
+long long houselights_metrics_clock (void) {
+    struct timeval now;
+    gettimeofday (&now, 0);
+    return (now.tv_sec * 1000000LL) + now.tv_usec;
+}
+
+void houselights_metrics_record (LightsHistogram *h, long long value) {
+
+    int i;
+    long long bound = h->scale;
+
+    for (i = 0; i < LIGHTS_HISTOGRAM_BUCKETS; ++i) {
+        if (value <= bound) break;
+        bound *= 4;
+    }
+    h->buckets[i] += 1;
+    h->count += 1;
+    h->sum += value;
+    if (value > h->max) h->max = value;
+}
+
+long long houselights_metrics_percentile (const LightsHistogram *h,
+                                          int percent) {
+    int i;
+    long long bound = h->scale;
+    long long rank = ((h->count * percent) + 99) / 100;
+    long long seen = 0;
+
+    if (h->count <= 0) return 0;
+
+    for (i = 0; i < LIGHTS_HISTOGRAM_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank) break;
+        bound *= 4;
+    }
+    if ((i >= LIGHTS_HISTOGRAM_BUCKETS) || (bound > h->max)) return h->max;
+    return bound;
+}
+
+void houselights_metrics_format (LightsOutput *out,
+                                 const char *name, const LightsHistogram *h) {
+
+    int i;
+    long long bound = h->scale;
+    const char *prefix = "";
+
+    houselights_output_format (out,
+                               "\"%s\":{\"count\":%lld,\"sum\":%lld,"
+                                   "\"max\":%lld,\"buckets\":[",
+                               name, h->count, h->sum, h->max);
+    for (i = 0; i < LIGHTS_HISTOGRAM_BUCKETS; ++i) {
+        houselights_output_format (out, "%s[%lld,%lld]",
+                                   prefix, bound, h->buckets[i]);
+        prefix = ",";
+        bound *= 4;
+    }
+    houselights_output_format (out, ",[null,%lld]]}", h->buckets[i]);
+}
@@ -0,0 +1,44 @@
+/* houseslights - A simple home web server for lighting control
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * houselights_metrics.h - Counters and histograms for runtime metrics.
+ */
+
+#define LIGHTS_HISTOGRAM_BUCKETS 10
+
+typedef struct {
+    long long scale; // Upper bound of the first bucket.
+    long long count;
+    long long sum;
+    long long max;
+    long long buckets[LIGHTS_HISTOGRAM_BUCKETS+1];
+} LightsHistogram;
+
+#define LIGHTS_HISTOGRAM(scale) {scale, 0, 0, 0, {0}}
+
+long long houselights_metrics_clock (void);
+
+void houselights_metrics_record (LightsHistogram *h, long long value);
+
+long long houselights_metrics_percentile (const LightsHistogram *h, int percent);
+
+void houselights_metrics_format (LightsOutput *out,
+                                 const char *name, const LightsHistogram *h);
+
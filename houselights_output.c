@@ -0,0 +1,133 @@
+/* houseslights - A simple home web server for lighting control
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * houselights_output.c - Build a (JSON) response in a growable buffer.
+ *
+ * SYNOPSYS:
+ *
+ * This module accumulates text directly into a buffer that grows as
+ * needed, so that the size of a response is never limited. The buffer
+ * is kept between uses, so that a steady state does not allocate memory.
+ * The content is always a valid nul terminated string.
+ *
+ * void houselights_output_reset (LightsOutput *out);
+ *
+ *    Empty the buffer, keeping the memory allocated for the next use.
+ *
+ * void houselights_output_append (LightsOutput *out, const char *text);
+ *
+ *    Append a string as-is.
+ *
+ * void houselights_output_format (LightsOutput *out, const char *format, ...);
+ *
+ *    Append the result of a printf-style formatting.
+ *
+ * char *houselights_output_reserve (LightsOutput *out, int size);
+ * void  houselights_output_commit  (LightsOutput *out, int length);
+ *
+ *    Give access to at least size bytes at the end of the buffer, for
+ *    use with functions that write into a fixed size buffer. The commit
+ *    function then accounts for the length actually written.
+ *
+ * void houselights_output_metrics (LightsOutput *out);
+ *
+ *    Append the counters of buffer growths and truncations, in JSON.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "houselights_output.h"
+
+#define OUTPUT_MINIMUM 4096
+
+static long long OutputGrowths = 0;
+static long long OutputTruncations = 0;
+
+static void houselights_output_grow (LightsOutput *out, int needed) {
+
+    if (out->length + needed < out->size) return;
+
+    int size = out->size ? out->size : OUTPUT_MINIMUM;
+    while (out->length + needed >= size) size *= 2;
+    out->data = realloc (out->data, size);
+    out->size = size;
+    OutputGrowths += 1;
+}
+
+void houselights_output_reset (LightsOutput *out) {
+    houselights_output_grow (out, 0);
+    out->length = 0;
+    out->data[0] = 0;
+}
+
+void houselights_output_append (LightsOutput *out, const char *text) {
+
+    int length = strlen(text);
+    houselights_output_grow (out, length);
+    memcpy (out->data + out->length, text, length+1);
+    out->length += length;
+}
+
+void houselights_output_format (LightsOutput *out, const char *format, ...) {
+
+    va_list args;
+
+    houselights_output_grow (out, 0);
+
+    va_start (args, format);
+    int length = vsnprintf (out->data + out->length,
+                            out->size - out->length, format, args);
+    va_end (args);
+    if (length < 0) return;
+
+    if (out->length + length >= out->size) {
+        // Did not fit: grow and do it again.
+        houselights_output_grow (out, length);
+        va_start (args, format);
+        vsnprintf (out->data + out->length,
+                   out->size - out->length, format, args);
+        va_end (args);
+    }
+    out->length += length;
+}
+
+char *houselights_output_reserve (LightsOutput *out, int size) {
+    houselights_output_grow (out, size);
+    return out->data + out->length;
+}
+
+void houselights_output_commit (LightsOutput *out, int length) {
+    if (length <= 0) return;
+    if (out->length + length >= out->size) {
+        length = out->size - out->length - 1; // Truncated.
+        OutputTruncations += 1;
+    }
+    out->length += length;
+    out->data[out->length] = 0;
+}
+
+void houselights_output_metrics (LightsOutput *out) {
+    houselights_output_format (out,
+                               "\"output\":{\"grown\":%lld,\"truncated\":%lld}",
+                               OutputGrowths, OutputTruncations);
+}
@@ -0,0 +1,40 @@
+/* houseslights - A simple home web server for lighting control
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * houselights_output.h - Build a (JSON) response in a growable buffer.
+ */
+
+typedef struct {
+    char *data;
+    int size;
+    int length;
+} LightsOutput;
+
+void houselights_output_reset (LightsOutput *out);
+
+void houselights_output_append (LightsOutput *out, const char *text);
+
+void houselights_output_format (LightsOutput *out, const char *format, ...)
+        __attribute__ ((format (printf, 2, 3)));
+
+char *houselights_output_reserve (LightsOutput *out, int size);
+void  houselights_output_commit  (LightsOutput *out, int length);
+
+void houselights_output_metrics (LightsOutput *out);
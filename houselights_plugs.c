@@ -27,6 +27,8 @@
  * - Run frequent poll for changes for servers that support it.
  * - Turn each plug on or off as requested. The requestor may be the
  *   schedule function, or a manual request from the outside.
+ * - Limit the number of requests sent concurrently to the servers, giving
+ *   priority to manual controls over scheduled controls over polls.
  *
  * This module is not configured by the user: it learns about a plug when
  * the other modules want to control it. Its job, really, is to find what
@@ -49,16 +51,66 @@
  *    are lights, we do not apply a pulse on the 'off' state. The pulse is
  *    meant to protect against leaving a light on and wasting electricity.
  *
+ * void houselights_plugs_lease
+ *          (const char *name, int duration, const char *cause);
+ *
+ *    Keep one plug on for the specified duration (in seconds). The plug
+ *    is controlled only when its current lease is about to expire, or
+ *    when it was not confirmed by the provider. This is meant for the
+ *    scheduler, which calls this function periodically.
+ *
+ * const char *houselights_plugs_state (const char *name);
+ *
+ *    Return the state last reported for the specified plug, or 0 if this
+ *    plug is not known.
+ *
+ * unsigned int houselights_plugs_hash (const char *name);
+ *
+ *    Return the hash of a plug name, as used for the plugs index. This is
+ *    shared with the other modules that index data by plug name.
+ *
+ * void houselights_plugs_flush (void);
+ *
+ *    Send all the controls queued since the last flush. The controls
+ *    for the same provider are combined into a single request when that
+ *    provider supports it. This should be called at the end of each event.
+ *
  * void houselights_plugs_periodic (time_t now);
  *
  *    The periodic function that runs the lights discovery logic.
  *
- * int houselights_plugs_status (char *buffer, int size);
+ * void houselights_plugs_status (LightsOutput *out);
  *
  *    A function that populates a complete status in JSON.
  *
+ * int houselights_plugs_delta (LightsOutput *out, unsigned long known);
+ *
+ *    A function that populates a status in JSON that lists only the plugs
+ *    that changed since the specified live state version. Return -1 if
+ *    the change history does not go back that far, or if more than half
+ *    of the plugs changed: the (shared) complete status is then better.
+ *
+ * void houselights_plugs_providers (LightsOutput *out);
+ *
+ *    A function that populates the list of providers in JSON, with
+ *    the statistics of the requests sent to each provider, and of the
+ *    request scheduler (queue depth, wait times in milliseconds).
+ *
+ * void houselights_plugs_metrics (LightsOutput *out);
+ *
+ *    A function that populates the runtime metrics of this module in JSON:
+ *    plug counts, requests per provider, HTTP codes, response sizes and
+ *    JSON parse times.
+ *
+ * void houselights_plugs_latency (LightsOutput *out);
+ *
+ *    A function that populates the control latency statistics in JSON:
+ *    percentiles per cause and per provider, and the recent slow controls.
+ *
  */
 
+#include <sys/time.h>
+
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -72,6 +124,8 @@
 #include "housediscover.h"
 
 #include "houselights.h"
+#include "houselights_output.h"
+#include "houselights_metrics.h"
 #include "houselights_plugs.h"
 
 #define DEBUG if (echttp_isdebug()) printf
@@ -80,83 +134,381 @@
 
 typedef struct {
     char *url;
+    char *status;      // Pre-built endpoint URLs for this provider.
+    char *control;
     long long known;
     time_t responded;  // last time we got an answer from this provider.
+    int batch;         // Provider accepts multiple points per control request.
+    int queued;        // Number of controls to send (during a flush only).
+    long long requests; // HTTP requests issued to this provider.
+    long long failures; // Requests that could not be issued (no connection).
+    long long errors;   // Requests that returned an HTTP error.
+    long long nextpoll; // When to poll next (milliseconds).
+    long long polled;   // When the last poll was issued (milliseconds).
+    int interval;       // Adaptive poll interval (milliseconds).
+    int phase;          // Fixed random offset, spreads the polls over time.
+    int backoff;        // Consecutive poll failures or timeouts.
+    int inflight;       // Requests sent and not yet answered.
+    int polling;        // A poll is waiting or in flight.
+    long long polls;    // Polls for changes.
+    long long scans;    // Full status requests (discovery).
+    long long controls; // Points controlled (individually or in batches).
+    long long batches;  // Batch control requests.
+    LightsHistogram latency; // Time to confirm a control (milliseconds).
 } LightProvider;
 
 static LightProvider *Providers;
 static int    ProvidersSize = 0;
 static int    ProvidersCount = 0;
 
+// Runtime metrics for the responses from all providers.
+//
+#define HTTP_CODES 16
+
+static struct {
+    int code;
+    long long count;
+} PlugsHttpCodes[HTTP_CODES];
+static long long PlugsHttpOther = 0; // Codes that did not fit in the table.
+
+static LightsHistogram PlugsResponseSize = LIGHTS_HISTOGRAM(256); // Bytes.
+static LightsHistogram PlugsParseTime = LIGHTS_HISTOGRAM(10); // Microseconds.
+static long long PlugsTokensGrown = 0;
+
+static void houselights_plugs_response (int status, int length) {
+
+    int i;
+    for (i = 0; i < HTTP_CODES; ++i) {
+        if (PlugsHttpCodes[i].code == status) break;
+        if (PlugsHttpCodes[i].code == 0) {
+            PlugsHttpCodes[i].code = status;
+            break;
+        }
+    }
+    if (i < HTTP_CODES)
+        PlugsHttpCodes[i].count += 1;
+    else
+        PlugsHttpOther += 1;
+
+    houselights_metrics_record (&PlugsResponseSize, length);
+}
+
+// Each provider is polled on its own schedule: fast while it reports
+// changes or a control is pending, slower while nothing changes, and
+// backing off exponentially when it does not respond.
+//
+// The polls are sent from the periodic function, which runs about once
+// every POLL_TICK: a poll is sent on the tick closest to its time, so that
+// the fast polls do not slip by one tick. Each provider has its own fixed
+// phase, up to a tenth of the interval, which spreads the slower polls to
+// different providers over different ticks.
+//
+// The adaptive interval only changes when the provider responds. The time
+// of the next poll is also moved by controls (poll soon) and by failures
+// (back off), without changing the adaptive interval.
+//
+#define POLL_FAST     1000 // milliseconds
+#define POLL_SLOW     5000
+#define POLL_BACKOFF 60000
+#define POLL_TICK     1000
+
+static void houselights_plugs_poll_at
+                (LightProvider *provider, long long now, int delay) {
+
+    if (delay > POLL_BACKOFF) delay = POLL_BACKOFF;
+    long long phase = ((long long)(provider->phase) * delay) / (10 * POLL_FAST);
+    provider->nextpoll = now + delay + phase;
+}
+
+static int houselights_plugs_poll_due (const LightProvider *provider,
+                                       long long now) {
+    return now >= provider->nextpoll - (POLL_TICK / 2);
+}
+
+static void houselights_plugs_poll_failed
+                (LightProvider *provider, long long now) {
+
+    if (provider->backoff < 6) provider->backoff += 1;
+    houselights_plugs_poll_at (provider, now, POLL_FAST << provider->backoff);
+}
+
+// The plug table is split in two: the LightPlug records hold all the
+// fields that the periodic scans and the status serializer walk through,
+// while the LightPlugText records hold the data that is only used when
+// controlling one specific plug (cause, latency trace) or when building
+// a delta status. The two tables are indexed the same way. The URL of
+// a plug is the URL of its provider (parent).
+//
 typedef struct {
     char *name;
-    char *gear;
-    char *mode;
-    int parent;
+    unsigned int hash;
+    int parent; // -1: unmapped.
     const char *commanded;
-    char *cause;
-    char state[8];
-    int countdown;
-    int pulse;
     time_t requested;
     time_t deadline;
+    time_t leased; // End of the pulse confirmed by the provider, 0 if none.
+    char state[8];
+    short countdown;
+    int pending; // Position in the pending heap + 1, 0 if not pending.
     char manual;
+    char queued; // Control waiting for the next flush.
+    char waiting; // Control waiting for the request scheduler.
     char status; // u: unmapped, i: idle, a: active (pending).
-    char url[256];
+    char *gear;
+    char *mode;
 } LightPlug;
 
+typedef struct {
+    char *cause;
+    unsigned int reported; // Used to avoid duplicates in a delta status.
+    long long accepted;    // Trace of the latest control (milliseconds).
+    long long submitted;
+    long long acknowledged;
+} LightPlugText;
+
 #define MAX_LIFE  3
 
 static LightPlug *Plugs = 0;
+static LightPlugText *PlugsText = 0;
 static int       PlugsSize = 0;
 static int       PlugsCount = 0;
 
 #define PLUG_ON_LIMIT (8*60*60)    // do not set a light on for longer
 #define PLUG_CONTROL_EXPIRATION 60 // Do not retry for longer than this.
 
-static void houselights_plugs_submit (int plug, int manual, const char *cause);
+// A scheduled plug is kept on using leases: the plug is turned on with
+// a pulse of PLUG_LEASE seconds (or up to the end of the schedule, if
+// sooner), and the control is renewed only when the pulse confirmed by
+// the provider is about to expire. If this service stops, the lights
+// go off on their own when the last lease expires.
+//
+#define PLUG_LEASE       300
+#define PLUG_LEASE_RENEW  60 // Renew when less than this is left.
+
+// Each control is traced from the time it was accepted, to the time
+// the request was sent, the time the provider acknowledged it and the
+// time the provider reported the commanded state. The latencies are
+// accumulated per cause and per provider. The controls that took longer
+// than PLUG_TRACE_SLOW to be confirmed are kept in a ring for inspection.
+//
+#define PLUG_TRACE_SLOW 2000 // milliseconds.
+#define PLUG_TRACE_RING 32
 
-static int houselights_plugs_search (const char *name) {
-    int i;
-    int free = -1;
+typedef struct {
+    char name[32];
+    int provider;
+    char manual;
+    time_t accepted;
+    int submitted;    // Milliseconds after the control was accepted.
+    int acknowledged;
+    int confirmed;
+} LightTrace;
 
-    for (i = PlugsCount-1; i >= 0; --i) {
-        if (Plugs[i].name) {
-            if (!strcmp (name, Plugs[i].name)) return i;
-        } else {
-            free = i;
+static LightTrace PlugsSlow[PLUG_TRACE_RING];
+static int        PlugsSlowCount = 0; // Total number of slow controls.
+
+typedef struct {
+    LightsHistogram submitted;
+    LightsHistogram acknowledged;
+    LightsHistogram confirmed;
+} LightLatency;
+
+static LightLatency PlugsLatency[2] = { // 0: scheduled, 1: manual.
+    {LIGHTS_HISTOGRAM(10), LIGHTS_HISTOGRAM(10), LIGHTS_HISTOGRAM(10)},
+    {LIGHTS_HISTOGRAM(10), LIGHTS_HISTOGRAM(10), LIGHTS_HISTOGRAM(10)}
+};
+
+// The controls are not sent immediately: they are queued until the
+// end of the current event, then sent together, one request per provider
+// when the provider supports it.
+//
+// The changes to plugs are recorded in a ring buffer, with the live state
+// version that resulted from each change. This is used to build a delta
+// status that lists only the plugs changed since a client's known version.
+// A client that is further behind than what the ring covers gets a full
+// status instead.
+//
+typedef struct {
+    unsigned long version;
+    int plug;
+} LightPlugChange;
+
+#define PLUG_CHANGE_LOG 1024
+
+static LightPlugChange PlugsChanges[PLUG_CHANGE_LOG];
+static int PlugsChangesCount = 0; // Total number of changes ever recorded.
+static unsigned long PlugsChangesFloor = 0; // Oldest version fully covered.
+static int PlugsChangesInitialized = 0;
+
+static int *PlugsQueue = 0;
+static int  PlugsQueueSize = 0;
+static int  PlugsQueueCount = 0;
+
+static void houselights_plugs_submit (int plug);
+
+// The plugs are indexed by name using an open addressing hash table with
+// linear probing. Each bucket contains the plug index + 1 (0: empty bucket).
+// The table is kept at most half full, so that probe sequences remain short.
+//
+static int *PlugsIndex = 0;
+static int  PlugsIndexSize = 0; // Always a power of 2.
+static int  PlugsIndexCount = 0;
+
+// The slots released when pruning plugs are reused before growing the table.
+static int *PlugsFree = 0;
+static int  PlugsFreeCount = 0;
+
+static void houselights_plugs_record (int plug) {
+
+    unsigned long version = houselights_livelatest ();
+    if (!PlugsChangesInitialized) {
+        PlugsChangesFloor = version;
+        PlugsChangesInitialized = 1;
+    }
+    LightPlugChange *change = PlugsChanges + (PlugsChangesCount % PLUG_CHANGE_LOG);
+    if (PlugsChangesCount >= PLUG_CHANGE_LOG)
+        PlugsChangesFloor = change->version + 1; // That change is lost.
+    change->version = version;
+    change->plug = plug;
+    PlugsChangesCount += 1;
+}
+
+static void houselights_plugs_changed (int plug) {
+    houselights_liveupdate ();
+    houselights_plugs_record (plug);
+}
+
+// Some changes cannot be described as a delta, e.g. a removed plug.
+// Any client that is not up to date must then get a full status.
+//
+static void houselights_plugs_reset (void) {
+    houselights_liveupdate ();
+    PlugsChangesFloor = houselights_livelatest ();
+    PlugsChangesInitialized = 1;
+}
+
+unsigned int houselights_plugs_hash (const char *name) {
+    unsigned int hash = 2166136261u; // FNV-1a.
+    while (*name) {
+        hash ^= (unsigned char)(*(name++));
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int houselights_plugs_index_find (const char *name, unsigned int hash) {
+
+    if (PlugsIndexSize <= 0) return -1;
+
+    unsigned int mask = PlugsIndexSize - 1;
+    unsigned int i;
+    for (i = hash & mask; PlugsIndex[i]; i = (i + 1) & mask) {
+        LightPlug *plug = Plugs + PlugsIndex[i] - 1;
+        if ((plug->hash == hash) && (!strcmp (name, plug->name)))
+            return PlugsIndex[i] - 1;
+    }
+    return -1;
+}
+
+static void houselights_plugs_index_add (int plug) {
+
+    unsigned int mask = PlugsIndexSize - 1;
+    unsigned int i = Plugs[plug].hash & mask;
+    while (PlugsIndex[i]) i = (i + 1) & mask;
+    PlugsIndex[i] = plug + 1;
+    PlugsIndexCount += 1;
+}
+
+static void houselights_plugs_index_insert (int plug) {
+
+    if (2 * (PlugsIndexCount + 1) > PlugsIndexSize) {
+        int i;
+        if (PlugsIndex) free (PlugsIndex);
+        PlugsIndexSize = PlugsIndexSize ? 2 * PlugsIndexSize : 64;
+        PlugsIndex = calloc (PlugsIndexSize, sizeof(int));
+        PlugsIndexCount = 0;
+        for (i = 0; i < PlugsCount; ++i) {
+            if ((i != plug) && Plugs[i].name) houselights_plugs_index_add (i);
+        }
+    }
+    houselights_plugs_index_add (plug);
+}
+
+static void houselights_plugs_index_remove (int plug) {
+
+    if (PlugsIndexSize <= 0) return;
+
+    unsigned int mask = PlugsIndexSize - 1;
+    unsigned int i = Plugs[plug].hash & mask;
+    while (PlugsIndex[i] != plug + 1) {
+        if (!PlugsIndex[i]) return; // Not indexed.
+        i = (i + 1) & mask;
+    }
+
+    // Shift back the entries that follow in the same probe sequence,
+    // so that no tombstone is needed.
+    unsigned int j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!PlugsIndex[j]) break;
+        unsigned int home = Plugs[PlugsIndex[j]-1].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            PlugsIndex[i] = PlugsIndex[j];
+            i = j;
         }
     }
-    if (free < 0) {
+    PlugsIndex[i] = 0;
+    PlugsIndexCount -= 1;
+}
+
+static int houselights_plugs_search (const char *name) {
+
+    unsigned int hash = houselights_plugs_hash (name);
+    int free = houselights_plugs_index_find (name, hash);
+    if (free >= 0) return free;
+
+    if (PlugsFreeCount > 0) {
+        free = PlugsFree[--PlugsFreeCount];
+    } else {
         if (PlugsCount >= PlugsSize) {
             PlugsSize += 32;
             Plugs = realloc (Plugs, PlugsSize * sizeof(LightPlug));
+            PlugsText = realloc (PlugsText, PlugsSize * sizeof(LightPlugText));
+            PlugsFree = realloc (PlugsFree, PlugsSize * sizeof(int));
         }
         free = PlugsCount++;
     }
     Plugs[free].name = strdup(name);
+    Plugs[free].hash = hash;
     Plugs[free].parent = -1;
     Plugs[free].countdown = MAX_LIFE;
-    Plugs[free].mode = 0;
     Plugs[free].commanded = 0;
     Plugs[free].requested = 0;
     Plugs[free].deadline = 0;
+    Plugs[free].leased = 0;
     Plugs[free].state[0] = 0;
-    Plugs[free].pulse = 0;
     Plugs[free].manual = 0;
-    Plugs[free].cause = 0;
-    Plugs[free].gear = 0;
+    Plugs[free].queued = 0;
+    Plugs[free].waiting = 0;
+    Plugs[free].pending = 0;
     Plugs[free].status = 'u';
-    Plugs[free].url[0] = 0;
+    Plugs[free].gear = 0;
+    Plugs[free].mode = 0;
+    PlugsText[free].cause = 0;
+    PlugsText[free].reported = 0;
+    PlugsText[free].accepted = 0;
+    houselights_plugs_index_insert (free);
 
     houselights_configupdate ();
+    houselights_plugs_record (free);
     return free;
 }
 
 static int houselights_plugs_is_output (int plug) {
-    if (!Plugs[plug].mode) return 1; // Default is yes.
-    if (!strcmp (Plugs[plug].mode, "out")) return 1;
-    if (!strcmp (Plugs[plug].mode, "output")) return 1;
+    const char *mode = Plugs[plug].mode;
+    if (!mode) return 1; // Default is yes.
+    if (!strcmp (mode, "out")) return 1;
+    if (!strcmp (mode, "output")) return 1;
     return 0;
 }
 
@@ -172,16 +524,160 @@ static int houselights_plugs_provider_search (const char *provider) {
 
     i = ProvidersCount++;
     Providers[i].url = strdup(provider); // Keep the string.
+
+    int length = strlen(provider) + 8;
+    Providers[i].status = malloc (length);
+    snprintf (Providers[i].status, length, "%s/status", provider);
+    Providers[i].control = malloc (length);
+    snprintf (Providers[i].control, length, "%s/set", provider);
+    Providers[i].requests = 0;
+    Providers[i].failures = 0;
+    Providers[i].polls = 0;
+    Providers[i].scans = 0;
+    Providers[i].controls = 0;
+    Providers[i].batches = 0;
+    Providers[i].latency = (LightsHistogram) LIGHTS_HISTOGRAM(10);
+    Providers[i].errors = 0;
+    Providers[i].nextpoll = 0;
+    Providers[i].polled = 0;
+    Providers[i].interval = POLL_FAST;
+    struct timeval random;
+    gettimeofday (&random, 0);
+    Providers[i].phase = (int)((random.tv_usec ^ (i * 7919)) % POLL_FAST);
+    Providers[i].backoff = 0;
+    Providers[i].inflight = 0;
+    Providers[i].polling = 0;
     Providers[i].known = 0;
     Providers[i].responded = 0;
+    Providers[i].batch = 0;
+    Providers[i].queued = 0;
     return i;
 }
 
-static int houselights_plugs_pending (int plug) {
+static const char *houselights_plugs_url (int plug) {
+    if (Plugs[plug].parent < 0) return 0;
+    return Providers[Plugs[plug].parent].url;
+}
+
+// Create the client connection for a request to the specified provider.
+// A provider that cannot be reached is not polled anymore until the next
+// discovery, which will find it again (possibly on a new port).
+//
+// The echttp client opens a new connection for each request, and closes
+// it once the response was received: there is no way to keep connections
+// alive, and thus no connection pool. What can be saved is done here: the
+// endpoint URLs are built once per provider.
+//
+static const char *houselights_plugs_request
+                       (int provider, const char *method, const char *url) {
+
+    const char *error = echttp_client (method, url);
+    if (error) {
+        Providers[provider].failures += 1;
+        Providers[provider].known = 0;
+        return error;
+    }
+    Providers[provider].requests += 1;
+    return 0;
+}
+
+static void houselights_plugs_update (int plug, char status) {
+    if (Plugs[plug].status == status) return;
+    Plugs[plug].status = status;
+    houselights_plugs_changed (plug);
+}
+
+// The controls that have not been confirmed yet are kept in a min-heap
+// ordered by the time when they stop being pending (expiration of the
+// retries, or end of the pulse). This way the periodic processing is
+// proportional to the number of outstanding controls, not to the number
+// of plugs.
+//
+static int *PlugsPending = 0;
+static int  PlugsPendingSize = 0;
+static int  PlugsPendingCount = 0;
+
+static time_t houselights_plugs_expiry (int plug) {
+    time_t expiry = Plugs[plug].requested + PLUG_CONTROL_EXPIRATION + 1;
+    if ((Plugs[plug].deadline > 0) && (Plugs[plug].deadline < expiry))
+        return Plugs[plug].deadline;
+    return expiry;
+}
+
+static void houselights_plugs_pending_place (int position, int plug) {
+    PlugsPending[position] = plug;
+    Plugs[plug].pending = position + 1;
+}
+
+static void houselights_plugs_pending_up (int position) {
+
+    int plug = PlugsPending[position];
+    time_t expiry = houselights_plugs_expiry (plug);
+
+    while (position > 0) {
+        int parent = (position - 1) / 2;
+        if (houselights_plugs_expiry (PlugsPending[parent]) <= expiry) break;
+        houselights_plugs_pending_place (position, PlugsPending[parent]);
+        position = parent;
+    }
+    houselights_plugs_pending_place (position, plug);
+}
+
+static void houselights_plugs_pending_down (int position) {
+
+    int plug = PlugsPending[position];
+    time_t expiry = houselights_plugs_expiry (plug);
+
+    for (;;) {
+        int child = (2 * position) + 1;
+        if (child >= PlugsPendingCount) break;
+        time_t childexpiry = houselights_plugs_expiry (PlugsPending[child]);
+        if (child + 1 < PlugsPendingCount) {
+            time_t other = houselights_plugs_expiry (PlugsPending[child+1]);
+            if (other < childexpiry) {
+                child += 1;
+                childexpiry = other;
+            }
+        }
+        if (expiry <= childexpiry) break;
+        houselights_plugs_pending_place (position, PlugsPending[child]);
+        position = child;
+    }
+    houselights_plugs_pending_place (position, plug);
+}
+
+static void houselights_plugs_pending_remove (int plug) {
+
+    int position = Plugs[plug].pending - 1;
+    if (position < 0) return;
+    Plugs[plug].pending = 0;
+
+    int last = PlugsPending[--PlugsPendingCount];
+    if (last == plug) return; // That was the last item.
+
+    PlugsPending[position] = last;
+    houselights_plugs_pending_up (position);
+    houselights_plugs_pending_down (Plugs[last].pending - 1);
+}
+
+static void houselights_plugs_pending_add (int plug) {
+
+    houselights_plugs_pending_remove (plug); // The expiration changed.
+
+    if (PlugsPendingCount >= PlugsPendingSize) {
+        PlugsPendingSize += 32;
+        PlugsPending = realloc (PlugsPending, PlugsPendingSize * sizeof(int));
+    }
+    PlugsPending[PlugsPendingCount] = plug;
+    Plugs[plug].pending = ++PlugsPendingCount;
+    houselights_plugs_pending_up (PlugsPendingCount - 1);
+}
+
+static int houselights_plugs_pending (int plug, time_t now) {
 
     // Find all the cases when we would not need or want to issue a control.
     //
-    time_t now = time(0);
+    if (!Plugs[plug].pending) return 0;
     if (Plugs[plug].requested + PLUG_CONTROL_EXPIRATION < now) return 0;
     if ((Plugs[plug].deadline > 0) && (Plugs[plug].deadline <= now)) return 0;
     if (!Plugs[plug].commanded) return 0;
@@ -191,19 +687,84 @@ static int houselights_plugs_pending (int plug) {
     return 1; // No reason for not submitting a control.
 }
 
-#define TOKEN_LIMIT 512
+static void houselights_plugs_traced (int plug) {
+
+    LightPlugText *text = PlugsText + plug;
+
+    if (!text->accepted) return;
+    if (!text->submitted) {
+        text->accepted = 0; // Confirmed before being sent: not a latency.
+        return;
+    }
+    int submitted = (int)(text->submitted - text->accepted);
+    int acknowledged =
+        text->acknowledged ? (int)(text->acknowledged - text->accepted) : 0;
+    int confirmed = (int)((houselights_metrics_clock () / 1000) - text->accepted);
+
+    LightLatency *latency = PlugsLatency + (Plugs[plug].manual ? 1 : 0);
+    houselights_metrics_record (&(latency->submitted), submitted);
+    if (acknowledged)
+        houselights_metrics_record (&(latency->acknowledged), acknowledged);
+    houselights_metrics_record (&(latency->confirmed), confirmed);
+    if (Plugs[plug].parent >= 0)
+        houselights_metrics_record
+            (&(Providers[Plugs[plug].parent].latency), confirmed);
+
+    if (confirmed >= PLUG_TRACE_SLOW) {
+        LightTrace *slow = PlugsSlow + (PlugsSlowCount++ % PLUG_TRACE_RING);
+        snprintf (slow->name, sizeof(slow->name), "%s", Plugs[plug].name);
+        slow->provider = Plugs[plug].parent;
+        slow->manual = Plugs[plug].manual;
+        slow->accepted = (time_t)(text->accepted / 1000);
+        slow->submitted = submitted;
+        slow->acknowledged = acknowledged;
+        slow->confirmed = confirmed;
+    }
+    text->accepted = 0;
+}
+
+// The JSON parser works from arrays provided by the caller. These arrays
+// are sized from each response and kept for the next one, so that there is
+// no limit on the number of points reported by a provider, and no memory
+// allocation once the largest response has been seen.
+//
+static ParserToken *DiscoveryTokens = 0;
+static int          DiscoveryTokensSize = 0;
+static int *DiscoveryList = 0;
+static int  DiscoveryListSize = 0;
+
+static int *houselights_plugs_list (int count) {
+    if (count > DiscoveryListSize) {
+        DiscoveryListSize = count + 64;
+        DiscoveryList = realloc (DiscoveryList, DiscoveryListSize * sizeof(int));
+    }
+    return DiscoveryList;
+}
 
 static void houselights_plugs_discovery (const char *provider,
                                          char *data, int length) {
 
-   ParserToken tokens[TOKEN_LIMIT];
-   int  innerlist[TOKEN_LIMIT];
-   int  count = TOKEN_LIMIT;
-   char path[256];
-   int  i;
+   int  i, j;
+
+   int count = echttp_json_estimate (data);
+   if (count <= 0) {
+       houselog_trace (HOUSE_FAILURE, provider, "no data");
+       return;
+   }
+   if (count > DiscoveryTokensSize) {
+       DiscoveryTokensSize = count + 64;
+       DiscoveryTokens =
+           realloc (DiscoveryTokens, DiscoveryTokensSize * sizeof(ParserToken));
+       PlugsTokensGrown += 1;
+   }
+   ParserToken *tokens = DiscoveryTokens;
+   count = DiscoveryTokensSize;
 
    // Analyze the answer and retrieve the control points matching our plugs.
+   long long parsing = houselights_metrics_clock ();
    const char *error = echttp_json_parse (data, tokens, &count);
+   houselights_metrics_record
+       (&PlugsParseTime, houselights_metrics_clock () - parsing);
    if (error) {
        houselog_trace
            (HOUSE_FAILURE, provider, "JSON syntax error, %s", error);
@@ -221,6 +782,12 @@ static void houselights_plugs_discovery (const char *provider,
    }
    Providers[parent].responded = time(0);
 
+   int batch = echttp_json_search (tokens, ".control.batch");
+   if (batch >= 0) {
+       Providers[parent].batch = (tokens[batch].type == PARSER_BOOL) &&
+                                 tokens[batch].value.bool;
+   }
+
    int controls = echttp_json_search (tokens, ".control.status");
    if (controls <= 0) {
        houselog_trace (HOUSE_FAILURE, provider, "no plug data");
@@ -233,9 +800,13 @@ static void houselights_plugs_discovery (const char *provider,
        return;
    }
 
-   error = echttp_json_enumerate (tokens+controls, innerlist, TOKEN_LIMIT);
+   // The list of controls and the list of fields for each control are
+   // stored in the same array, the fields following the controls.
+   //
+   int *innerlist = houselights_plugs_list (n);
+   error = echttp_json_enumerate (tokens+controls, innerlist, n);
    if (error) {
-       houselog_trace (HOUSE_FAILURE, path, "%s", error);
+       houselog_trace (HOUSE_FAILURE, provider, "%s", error);
        return;
    }
 
@@ -245,118 +816,332 @@ static void houselights_plugs_discovery (const char *provider,
        int plug = houselights_plugs_search (inner->key);
        if (plug < 0) continue;
 
-       Plugs[plug].parent = parent;
+       LightPlugText *text = PlugsText + plug;
+
+       // Extract all the fields of interest in a single pass.
+       const char *mode = 0;
+       const char *state = 0;
+       const char *gear = 0;
+       if ((inner->type == PARSER_OBJECT) && (inner->length > 0)) {
+           int *fields = houselights_plugs_list (n + inner->length) + n;
+           innerlist = DiscoveryList; // In case it moved.
+           if (!echttp_json_enumerate (inner, fields, inner->length)) {
+               for (j = 0; j < inner->length; ++j) {
+                   ParserToken *field = inner + fields[j];
+                   if (field->type != PARSER_STRING) continue;
+                   const char *key = field->key;
+                   if (!strcmp (key, "state")) state = field->value.string;
+                   else if (!strcmp (key, "mode")) mode = field->value.string;
+                   else if (!strcmp (key, "gear")) gear = field->value.string;
+               }
+           }
+       }
 
-       int mode = echttp_json_search (inner, ".mode");
-       if (mode >= 0) {
-           const char *value = inner[mode].value.string;
+       if (mode) {
+           const char *value = mode;
            if ((!Plugs[plug].mode) || strcmp (Plugs[plug].mode, value)) {
                if (Plugs[plug].mode) free (Plugs[plug].mode);
                Plugs[plug].mode = strdup (value);
+               houselights_plugs_changed (plug);
            }
        } else if (Plugs[plug].mode) {
            free (Plugs[plug].mode);
            Plugs[plug].mode = 0;
+           houselights_plugs_changed (plug);
        }
 
-       int state = echttp_json_search (inner, ".state");
-       if (state >= 0) {
-           if (strcmp (Plugs[plug].state, inner[state].value.string)) {
+       if (state) {
+           if (strcmp (Plugs[plug].state, state)) {
                int hasstate = (Plugs[plug].state[0] > 0);
-               strncpy (Plugs[plug].state,
-                        inner[state].value.string, sizeof(Plugs[0].state));
+               strncpy (Plugs[plug].state, state, sizeof(Plugs[0].state));
                if (hasstate) {
                    // Do not report the initial state acquisition as a change.
                    houselog_event ("PLUG", Plugs[plug].name, "CHANGED",
                                    "TO %s", Plugs[plug].state);
                }
-               houselights_liveupdate ();
+               houselights_plugs_changed (plug);
+           }
+           if (Plugs[plug].leased && Plugs[plug].commanded &&
+               strcmp (state, Plugs[plug].commanded) &&
+               strcmp (state, "silent") && (!Plugs[plug].pending)) {
+               Plugs[plug].leased = 0; // Changed behind our back.
+           }
+           if (Plugs[plug].pending) {
+               // Stop tracking a control that was confirmed.
+               if (Plugs[plug].commanded &&
+                   (!strcmp (state, Plugs[plug].commanded))) {
+                   houselights_plugs_pending_remove (plug);
+                   houselights_plugs_traced (plug);
+               } else if (!strcmp (state, "silent")) {
+                   houselights_plugs_pending_remove (plug);
+               }
            }
        }
 
-       if (strcmp (Plugs[plug].url, provider)) {
-           if (Plugs[plug].url[0]) {
+       if (Plugs[plug].parent != parent) {
+           if (Plugs[plug].parent >= 0) {
                // A change of server is very unusual. Let store these events.
                houselog_event ("PLUG", Plugs[plug].name , "ROUTE",
-                               "CHANGED FROM %s TO %s", Plugs[plug].url, provider);
+                               "CHANGED FROM %s TO %s",
+                               Providers[Plugs[plug].parent].url, provider);
            } else {
                houselog_event_local ("PLUG", Plugs[plug].name, "ROUTE",
                                      "SET TO %s", provider);
            }
-           snprintf (Plugs[plug].url, sizeof(Plugs[plug].url), provider);
+           Plugs[plug].parent = parent;
            if (Plugs[plug].status == 'u') Plugs[plug].status = 'i';
+           houselights_plugs_changed (plug);
 
-           DEBUG ("Plug %s discovered on %s\n",
-                  Plugs[plug].name, Plugs[plug].url);
+           DEBUG ("Plug %s discovered on %s\n", Plugs[plug].name, provider);
 
            // If we discovered a plug for which there is a pending control,
            // This is the best time to submit it.
            //
-           if (houselights_plugs_pending (plug)) {
+           if (houselights_plugs_pending (plug, time(0))) {
                houselog_event ("PLUG", Plugs[plug].name, "RETRY",
                                "%s (%s)",
-                               Plugs[plug].commanded, Plugs[plug].cause);
-               houselights_plugs_submit
-                   (plug, Plugs[plug].manual, Plugs[plug].cause);
+                               Plugs[plug].commanded, text->cause);
+               houselights_plugs_submit (plug);
            }
        }
 
        Plugs[plug].countdown = MAX_LIFE; // New lease in life.
 
-       int gear = echttp_json_search (inner, ".gear");
-       if (gear >= 0) {
-           const char *value = inner[gear].value.string;
+       if (gear) {
+           const char *value = gear;
            if (!Plugs[plug].gear) {
                Plugs[plug].gear = strdup (value);
+               houselights_plugs_changed (plug);
            } else if (strcasecmp (value, Plugs[plug].gear)) {
                free (Plugs[plug].gear);
                Plugs[plug].gear = strdup (value);
+               houselights_plugs_changed (plug);
            }
        } else if (Plugs[plug].gear) {
            free (Plugs[plug].gear);
            Plugs[plug].gear = 0;
+           houselights_plugs_changed (plug);
        }
    }
+   houselights_plugs_flush (); // Send the retries, if any.
+}
+
+// All the requests to providers go through a scheduler that limits the
+// number of requests in flight, per provider and overall. The requests
+// waiting for a slot are dispatched by priority: manual controls first,
+// then scheduled controls, then polls. Only one poll per provider may be
+// waiting or in flight at any time: extra polls are dropped.
+// A request that got no response after REQUEST_TIMEOUT does not count
+// anymore against the limits.
+//
+#define REQUEST_MANUAL     0
+#define REQUEST_SCHEDULE   1
+#define REQUEST_POLL       2
+#define REQUEST_PRIORITIES 3
+
+#define REQUEST_PER_PROVIDER 2
+#define REQUEST_GLOBAL      16
+#define REQUEST_TIMEOUT  10000 // milliseconds
+
+// A batch control is a POST to the provider's /set URI, with a JSON body:
+//    {"controls":[{"point":"..","state":"..","pulse":N,"cause":".."},..]}
+// The provider answers with its status, same as for a single point control.
+// The body is built when the request is sent, to use the latest commands.
+//
+typedef struct {
+    char *body;
+    int length;
+    int count;
+    int plugs[];
+} LightBatch;
+
+typedef struct LightRequest {
+    struct LightRequest *next;
+    int provider;
+    int plug;           // Single point control only (-1 otherwise).
+    LightBatch *batch;  // Batch control only.
+    char priority;
+    char timedout;
+    long long queued;   // milliseconds.
+    long long started;  // milliseconds.
+} LightRequest;
+
+static LightRequest *RequestWaiting[REQUEST_PRIORITIES];
+static LightRequest *RequestWaitingLast[REQUEST_PRIORITIES];
+static LightRequest *RequestInFlight = 0;
+
+static int       RequestWaitingCount = 0;
+static int       RequestInFlightCount = 0;
+static long long RequestDispatched = 0;
+static long long RequestWaitTotal = 0; // milliseconds.
+static int       RequestWaitMax = 0;   // milliseconds.
+static long long RequestTimeouts = 0;
+
+static void houselights_plugs_dispatch (void);
+
+static LightRequest *houselights_plugs_new_request (int provider, int priority) {
+    LightRequest *request = calloc (1, sizeof(LightRequest));
+    request->provider = provider;
+    request->priority = priority;
+    request->plug = -1;
+    return request;
+}
+
+static void houselights_plugs_free_request (LightRequest *request) {
+    if (request->batch) {
+        if (request->batch->body) free (request->batch->body);
+        free (request->batch);
+    }
+    free (request);
+}
+
+static void houselights_plugs_enqueue (LightRequest *request) {
+
+    int priority = request->priority;
+
+    request->next = 0;
+    request->queued = houselights_metrics_clock () / 1000;
+    if (RequestWaitingLast[priority])
+        RequestWaitingLast[priority]->next = request;
+    else
+        RequestWaiting[priority] = request;
+    RequestWaitingLast[priority] = request;
+    RequestWaitingCount += 1;
+}
+
+// Stop counting this request as in flight. Return 0 if it had timed out.
+//
+static int houselights_plugs_complete (LightRequest *request) {
+
+    if (request->timedout) return 0;
+
+    LightRequest **cursor = &RequestInFlight;
+    while (*cursor && (*cursor != request)) cursor = &((*cursor)->next);
+    if (*cursor) *cursor = request->next;
+
+    Providers[request->provider].inflight -= 1;
+    RequestInFlightCount -= 1;
+    if ((request->plug < 0) && (!request->batch))
+        Providers[request->provider].polling = 0;
+    return 1;
+}
+
+static void houselights_plugs_timeout (long long now) {
+
+    LightRequest **cursor = &RequestInFlight;
+    while (*cursor) {
+        LightRequest *request = *cursor;
+        if (now < request->started + REQUEST_TIMEOUT) {
+            cursor = &(request->next);
+            continue;
+        }
+        houselights_plugs_complete (request); // Unlinks the request.
+        request->timedout = 1; // Freed when (if) the response comes.
+        RequestTimeouts += 1;
+        if ((request->plug < 0) && (!request->batch)) // Only polls back off.
+            houselights_plugs_poll_failed (Providers + request->provider, now);
+        houselog_trace (HOUSE_FAILURE, Providers[request->provider].url,
+                        "request timed out after %d ms", REQUEST_TIMEOUT);
+    }
 }
 
 static void houselights_plugs_discovered
                (void *origin, int status, char *data, int length) {
 
-   const char *provider = (const char *) origin;
+   LightRequest *request = (LightRequest *)origin;
+   LightProvider *provider = Providers + request->provider;
 
    status = echttp_redirected("GET");
    if (!status) {
        echttp_submit (0, 0, houselights_plugs_discovered, origin);
        return;
    }
+   houselights_plugs_response (status, length);
+   houselights_plugs_complete (request);
+   free (request);
+
+   // Adjust the poll schedule for this provider based on this response:
+   // poll fast when there are changes, slow down when there are none,
+   // back off on errors. Never poll faster than twice the response time.
+   //
+   long long now = houselights_metrics_clock () / 1000;
+   int latency = (int)(now - provider->polled);
+
+   if ((status == 200) || (status == 304)) {
+       provider->backoff = 0;
+       if (status == 200) {
+           provider->interval = POLL_FAST;
+       } else {
+           provider->interval += provider->interval / 2;
+           if (provider->interval > POLL_SLOW) provider->interval = POLL_SLOW;
+       }
+       int delay = provider->interval;
+       if (delay < 2 * latency) delay = 2 * latency;
+       houselights_plugs_poll_at (provider, now, delay);
+   } else {
+       houselights_plugs_poll_failed (provider, now);
+   }
 
    if (status != 200) {
-       if (status != 304)
-           houselog_trace (HOUSE_FAILURE, provider, "HTTP error %d", status);
-       return;
+       if (status != 304) {
+           houselog_trace (HOUSE_FAILURE, provider->url, "HTTP error %d", status);
+           provider->errors += 1;
+       }
+   } else {
+       houselights_plugs_discovery (provider->url, data, length);
    }
-   houselights_plugs_discovery (provider, data, length);
+   houselights_plugs_dispatch ();
 }
 
-static void houselights_plugs_poll_server (int index) {
+static int houselights_plugs_start_poll (LightRequest *request) {
 
-    char url[256];
+    char buffer[256];
+    int index = request->provider;
+    LightProvider *provider = Providers + index;
+    const char *url = provider->status;
 
-    if (Providers[index].known > 0) {
-        snprintf (url, sizeof(url), "%s/status?known=%llu",
-                  Providers[index].url, Providers[index].known);
-    } else {
-        snprintf (url, sizeof(url), "%s/status", Providers[index].url);
+    if (provider->known > 0) {
+        snprintf (buffer, sizeof(buffer), "%s?known=%llu",
+                  url, provider->known);
+        url = buffer;
     }
 
+    // The next poll is scheduled when the response comes, or when
+    // the request times out.
+    provider->polled = houselights_metrics_clock () / 1000;
+
     DEBUG ("Polling %s\n", url);
-    const char *error = echttp_client ("GET", url);
+    const char *error = houselights_plugs_request (index, "GET", url);
     if (error) {
-        houselog_trace (HOUSE_FAILURE, Providers[index].url, "%s", error);
-        return;
+        houselog_trace (HOUSE_FAILURE, provider->url, "%s", error);
+        houselights_plugs_poll_failed (provider, provider->polled);
+        return 0;
     }
-    echttp_submit
-        (0, 0, houselights_plugs_discovered, (void *)(Providers[index].url));
+    echttp_submit (0, 0, houselights_plugs_discovered, request);
+    if (provider->known > 0)
+        provider->polls += 1;
+    else
+        provider->scans += 1;
+    return 1;
+}
+
+static void houselights_plugs_poll_server (int index) {
+
+    if (Providers[index].polling) return; // One is enough.
+    Providers[index].polling = 1;
+
+    houselights_plugs_enqueue
+        (houselights_plugs_new_request (index, REQUEST_POLL));
+    houselights_plugs_dispatch ();
+}
+
+// A control was sent: the provider's state is expected to change soon.
+static void houselights_plugs_poll_soon (int index) {
+    LightProvider *provider = Providers + index;
+    if (provider->backoff) return; // Not responding: do not insist.
+    long long now = houselights_metrics_clock () / 1000;
+    if (provider->nextpoll > now + POLL_FAST)
+        houselights_plugs_poll_at (provider, now, POLL_FAST);
 }
 
 static void houselights_plugs_scan_server
@@ -370,83 +1155,400 @@ static void houselights_plugs_scan_server
 static void houselights_plugs_prune (time_t now) {
 
     int i;
+    int pruned = 0;
 
     for (i = PlugsCount-1; i >= 0; --i) {
-        if (houselights_plugs_pending (i)) continue;
+        if (houselights_plugs_pending (i, now)) continue;
         if (Plugs[i].name) {
             if (--(Plugs[i].countdown) <= 0) {
-                 DEBUG ("Plug %s on %s pruned\n", Plugs[i].name, Plugs[i].url);
+                 const char *url = houselights_plugs_url (i);
+                 if (!url) url = "(none)";
+                 DEBUG ("Plug %s on %s pruned\n", Plugs[i].name, url);
                  houselog_event
-                     ("PLUG", Plugs[i].name, "PRUNE", "FROM %s", Plugs[i].url);
+                     ("PLUG", Plugs[i].name, "PRUNE", "FROM %s", url);
+                houselights_plugs_index_remove (i);
+                houselights_plugs_pending_remove (i);
+                PlugsFree[PlugsFreeCount++] = i;
+                pruned = 1;
                 free(Plugs[i].name);
                 Plugs[i].name = 0;
                 if (Plugs[i].mode) free (Plugs[i].mode);
                 Plugs[i].mode = 0;
-                Plugs[i].url[0] = 0;
+                if (Plugs[i].gear) free (Plugs[i].gear);
+                Plugs[i].gear = 0;
+                if (PlugsText[i].cause) free (PlugsText[i].cause);
+                PlugsText[i].cause = 0;
                 Plugs[i].parent = -1;
             }
         }
     }
     while (PlugsCount > 0 && (!Plugs[PlugsCount-1].name)) PlugsCount -= 1;
+
+    // Forget the free slots that were trimmed from the end of the table.
+    int kept = 0;
+    for (i = 0; i < PlugsFreeCount; ++i) {
+        if (PlugsFree[i] < PlugsCount) PlugsFree[kept++] = PlugsFree[i];
+    }
+    PlugsFreeCount = kept;
+
+    if (pruned) houselights_plugs_reset ();
 }
 
 static void houselights_plugs_controlled
                (void *origin, int status, char *data, int length) {
 
-   LightPlug *plug = Plugs+(int)(0xffffffff & (intptr_t)origin);
+   LightRequest *request = (LightRequest *)origin;
+   int index = request->plug;
+   LightPlug *plug = Plugs + index;
 
    status = echttp_redirected("GET");
    if (!status) {
        echttp_submit (0, 0, houselights_plugs_controlled, origin);
        return;
    }
+   houselights_plugs_response (status, length);
+   houselights_plugs_complete (request);
+   free (request);
 
    // TBD: add an event to record that the command was processed. Too verbose?
    if (status != 200) {
-       if (plug->status != 'e') {
+       if (plug->parent >= 0) Providers[plug->parent].errors += 1;
+       if (plug->name && (plug->status != 'e')) {
            houselog_trace (HOUSE_FAILURE, plug->name, "HTTP code %d", status);
-           plug->status = 'e';
+           houselights_plugs_update (index, 'e');
        }
-       return;
+   } else if (plug->name) {
+       plug->leased = plug->deadline;
+       if (PlugsText[index].accepted)
+           PlugsText[index].acknowledged = houselights_metrics_clock () / 1000;
+       houselights_plugs_update (index, 'i');
+       if (data && (plug->parent >= 0))
+           houselights_plugs_discovery (Providers[plug->parent].url, data, length);
    }
-   plug->status = 'i';
-
-   if (!data) return;
-   houselights_plugs_discovery (plug->url, data, length);
+   houselights_plugs_dispatch ();
 }
 
-static void houselights_plugs_submit (int plug, int manual, const char *cause) {
-
-    static char url[512];
+static void houselights_plugs_submit (int plug) {
 
-    int pulse = 0;
-    time_t now = time(0);
-    char encoded[128];
+    if (Plugs[plug].queued) return; // The latest command will be sent.
 
-    if (! Plugs[plug].url[0]) {
-        houselog_event ("PLUG", Plugs[plug].name, "IGNORED", "NOT DISCOVERED");
-        return;
+    if (PlugsQueueCount >= PlugsQueueSize) {
+        PlugsQueueSize += 32;
+        PlugsQueue = realloc (PlugsQueue, PlugsQueueSize * sizeof(int));
     }
+    PlugsQueue[PlugsQueueCount++] = plug;
+    Plugs[plug].queued = 1;
+}
+
+static int houselights_plugs_pulse (int plug, time_t now) {
+    if (Plugs[plug].deadline > 0) return (int) (Plugs[plug].deadline - now);
+    return 0;
+}
+
+static int houselights_plugs_start_control (LightRequest *request) {
 
-    if (Plugs[plug].deadline > 0)
-        pulse = (int) (Plugs[plug].deadline - now);
+    int plug = request->plug;
+    int provider = request->provider;
 
+    Plugs[plug].waiting = 0;
+    if (Plugs[plug].parent != provider) return 0; // Pruned or moved.
+
+    char encoded[128];
+    char cause[128];
     echttp_encoding_escape (Plugs[plug].name, encoded, sizeof(encoded));
+    echttp_encoding_escape (PlugsText[plug].cause, cause, sizeof(cause));
 
-    snprintf (url, sizeof(url), "%s/set?point=%s&state=%s&pulse=%d&cause=%s",
-              Plugs[plug].url,
+    char url[512];
+    snprintf (url, sizeof(url), "%s?point=%s&state=%s&pulse=%d&cause=%s",
+              Providers[provider].control,
               encoded,
               Plugs[plug].commanded,
-              pulse,
+              houselights_plugs_pulse (plug, time(0)),
               cause);
-    const char *error = echttp_client ("GET", url);
+    const char *error = houselights_plugs_request (provider, "GET", url);
     if (error) {
         houselog_trace (HOUSE_FAILURE, Plugs[plug].name, "cannot create socket for %s, %s", url, error);
-        return;
+        return 0;
     }
     DEBUG ("GET %s\n", url);
-    echttp_submit (0, 0, houselights_plugs_controlled, (void *)((intptr_t)plug));
-    return;
+    echttp_submit (0, 0, houselights_plugs_controlled, request);
+    Providers[provider].controls += 1;
+    if (PlugsText[plug].accepted)
+        PlugsText[plug].submitted = houselights_metrics_clock () / 1000;
+    houselights_plugs_poll_soon (provider);
+    return 1;
+}
+
+static void houselights_plugs_batched
+               (void *origin, int status, char *data, int length) {
+
+   LightRequest *request = (LightRequest *)origin;
+   LightBatch *batch = request->batch;
+   int i;
+
+   status = echttp_redirected("POST");
+   if (!status) {
+       echttp_submit (batch->body, batch->length,
+                      houselights_plugs_batched, origin);
+       return;
+   }
+   houselights_plugs_response (status, length);
+   houselights_plugs_complete (request);
+
+   LightProvider *provider = Providers + request->provider;
+
+   if (status != 200) {
+       provider->errors += 1;
+       houselog_trace (HOUSE_FAILURE, provider->url,
+                       "HTTP code %d on batch of %d", status, batch->count);
+       if ((status == 400) || (status == 404) || (status == 405)) {
+           // The provider does not actually support batches: fall back
+           // to controlling each point individually.
+           provider->batch = 0;
+           for (i = 0; i < batch->count; ++i) {
+               int plug = batch->plugs[i];
+               if (Plugs[plug].parent == request->provider)
+                   houselights_plugs_submit (plug);
+           }
+           houselights_plugs_flush ();
+       } else {
+           for (i = 0; i < batch->count; ++i) {
+               int plug = batch->plugs[i];
+               if (Plugs[plug].name) houselights_plugs_update (plug, 'e');
+           }
+       }
+   } else {
+       for (i = 0; i < batch->count; ++i) {
+           int plug = batch->plugs[i];
+           if (!Plugs[plug].name) continue;
+           Plugs[plug].leased = Plugs[plug].deadline;
+           if (PlugsText[plug].accepted)
+               PlugsText[plug].acknowledged = houselights_metrics_clock () / 1000;
+           houselights_plugs_update (plug, 'i');
+       }
+       if (data) houselights_plugs_discovery (provider->url, data, length);
+   }
+   houselights_plugs_free_request (request);
+   houselights_plugs_dispatch ();
+}
+
+// Copy a string as the content of a JSON string: the quotes, backslashes
+// and control characters are escaped. The destination must be able to
+// hold 6 bytes per character, plus the terminating null.
+//
+static int houselights_plugs_escape (char *d, const char *s) {
+
+    static const char hex[] = "0123456789abcdef";
+    char *start = d;
+
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)(*s);
+        if ((c == '"') || (c == '\\')) {
+            *(d++) = '\\';
+            *(d++) = c;
+        } else if (c < 0x20) {
+            *(d++) = '\\';
+            *(d++) = 'u';
+            *(d++) = '0';
+            *(d++) = '0';
+            *(d++) = hex[c >> 4];
+            *(d++) = hex[c & 15];
+        } else {
+            *(d++) = c;
+        }
+    }
+    *d = 0;
+    return d - start;
+}
+
+static int houselights_plugs_start_batch (LightRequest *request) {
+
+    int i;
+    int provider = request->provider;
+    LightBatch *batch = request->batch;
+    time_t now = time(0);
+
+    int size = 32;
+    for (i = 0; i < batch->count; ++i) {
+        int plug = batch->plugs[i];
+        Plugs[plug].waiting = 0;
+        if (Plugs[plug].parent != provider) continue; // Pruned or moved.
+        size += 6 * (strlen(Plugs[plug].name) + strlen(PlugsText[plug].cause) +
+                     strlen(Plugs[plug].commanded)) + 64;
+    }
+    batch->body = malloc (size);
+
+    int cursor = snprintf (batch->body, size, "{\"controls\":[");
+    const char *prefix = "";
+    for (i = 0; i < batch->count; ++i) {
+        int plug = batch->plugs[i];
+        if (Plugs[plug].parent != provider) continue;
+        cursor += snprintf (batch->body+cursor, size-cursor,
+                            "%s{\"point\":\"", prefix);
+        cursor += houselights_plugs_escape
+                      (batch->body+cursor, Plugs[plug].name);
+        cursor += snprintf (batch->body+cursor, size-cursor, "\",\"state\":\"");
+        cursor += houselights_plugs_escape
+                      (batch->body+cursor, Plugs[plug].commanded);
+        cursor += snprintf (batch->body+cursor, size-cursor,
+                            "\",\"pulse\":%d,\"cause\":\"",
+                            houselights_plugs_pulse (plug, now));
+        cursor += houselights_plugs_escape
+                      (batch->body+cursor, PlugsText[plug].cause);
+        cursor += snprintf (batch->body+cursor, size-cursor, "\"}");
+        prefix = ",";
+    }
+    if (!prefix[0]) return 0; // Nothing left to control.
+    cursor += snprintf (batch->body+cursor, size-cursor, "]}");
+    batch->length = cursor;
+
+    const char *url = Providers[provider].control;
+    const char *error = houselights_plugs_request (provider, "POST", url);
+    if (error) {
+        houselog_trace (HOUSE_FAILURE, Providers[provider].url,
+                        "cannot create socket for %s, %s", url, error);
+        return 0;
+    }
+    DEBUG ("POST %s (%d points)\n", url, batch->count);
+    echttp_submit (batch->body, batch->length, houselights_plugs_batched, request);
+    Providers[provider].batches += 1;
+    Providers[provider].controls += batch->count;
+
+    long long submitted = houselights_metrics_clock () / 1000;
+    for (i = 0; i < batch->count; ++i) {
+        int plug = batch->plugs[i];
+        if (Plugs[plug].parent != provider) continue;
+        if (PlugsText[plug].accepted) PlugsText[plug].submitted = submitted;
+    }
+    houselights_plugs_poll_soon (provider);
+    return 1;
+}
+
+static void houselights_plugs_start (LightRequest *request, long long now) {
+
+    int wait = (int)(now - request->queued);
+    RequestDispatched += 1;
+    RequestWaitTotal += wait;
+    if (wait > RequestWaitMax) RequestWaitMax = wait;
+
+    int started;
+    if (request->batch) {
+        started = houselights_plugs_start_batch (request);
+    } else if (request->plug >= 0) {
+        started = houselights_plugs_start_control (request);
+    } else {
+        started = houselights_plugs_start_poll (request);
+    }
+    if (!started) {
+        if ((request->plug < 0) && (!request->batch))
+            Providers[request->provider].polling = 0;
+        houselights_plugs_free_request (request);
+        return;
+    }
+    request->started = now;
+    request->next = RequestInFlight;
+    RequestInFlight = request;
+    RequestInFlightCount += 1;
+    Providers[request->provider].inflight += 1;
+}
+
+static void houselights_plugs_dispatch (void) {
+
+    int priority;
+    long long now = houselights_metrics_clock () / 1000;
+
+    for (priority = 0; priority < REQUEST_PRIORITIES; ++priority) {
+        LightRequest *previous = 0;
+        LightRequest *request = RequestWaiting[priority];
+        while (request) {
+            if (RequestInFlightCount >= REQUEST_GLOBAL) return;
+            LightRequest *next = request->next;
+            if (Providers[request->provider].inflight < REQUEST_PER_PROVIDER) {
+                if (previous)
+                    previous->next = next;
+                else
+                    RequestWaiting[priority] = next;
+                if (RequestWaitingLast[priority] == request)
+                    RequestWaitingLast[priority] = previous;
+                RequestWaitingCount -= 1;
+                houselights_plugs_start (request, now);
+            } else {
+                previous = request;
+            }
+            request = next;
+        }
+    }
+}
+
+static void houselights_plugs_queue_batch (int provider, int first) {
+
+    int i;
+    int count = Providers[provider].queued;
+
+    LightRequest *request =
+        houselights_plugs_new_request (provider, REQUEST_SCHEDULE);
+    LightBatch *batch = malloc (sizeof(LightBatch) + count * sizeof(int));
+    batch->body = 0;
+    batch->length = 0;
+    batch->count = 0;
+    request->batch = batch;
+
+    for (i = first; i < PlugsQueueCount; ++i) {
+        int plug = PlugsQueue[i];
+        if (Plugs[plug].parent != provider) continue;
+        if (!Plugs[plug].queued) continue;
+        Plugs[plug].queued = 0;
+        if (Plugs[plug].manual) request->priority = REQUEST_MANUAL;
+        if (Plugs[plug].waiting) continue; // Already waiting to be sent.
+        Plugs[plug].waiting = 1;
+        batch->plugs[batch->count++] = plug;
+    }
+    Providers[provider].queued = 0;
+
+    if (batch->count > 0)
+        houselights_plugs_enqueue (request);
+    else
+        houselights_plugs_free_request (request);
+}
+
+void houselights_plugs_flush (void) {
+
+    int i;
+
+    if (PlugsQueueCount <= 0) return;
+
+    for (i = 0; i < PlugsQueueCount; ++i) {
+        int provider = Plugs[PlugsQueue[i]].parent;
+        if (provider >= 0) Providers[provider].queued += 1;
+    }
+
+    for (i = 0; i < PlugsQueueCount; ++i) {
+        int plug = PlugsQueue[i];
+        if (!Plugs[plug].queued) continue; // Already part of a batch.
+
+        int provider = Plugs[plug].parent;
+        if ((provider >= 0) &&
+            Providers[provider].batch && (Providers[provider].queued > 1)) {
+            houselights_plugs_queue_batch (provider, i);
+            continue;
+        }
+        Plugs[plug].queued = 0;
+        if (!Plugs[plug].name) continue; // Pruned meanwhile.
+        if (provider < 0) {
+            houselog_event ("PLUG", Plugs[plug].name, "IGNORED", "NOT DISCOVERED");
+            continue;
+        }
+        Providers[provider].queued -= 1;
+        if (Plugs[plug].waiting) continue; // Already waiting to be sent.
+        Plugs[plug].waiting = 1;
+
+        LightRequest *request = houselights_plugs_new_request
+            (provider, Plugs[plug].manual ? REQUEST_MANUAL : REQUEST_SCHEDULE);
+        request->plug = plug;
+        houselights_plugs_enqueue (request);
+    }
+    PlugsQueueCount = 0;
+    houselights_plugs_dispatch ();
 }
 
 void houselights_plugs_set (const char *name, const char *state,
@@ -468,8 +1570,14 @@ void houselights_plugs_set (const char *name, const char *state,
     Plugs[plug].requested = now;
     Plugs[plug].commanded = state;
     Plugs[plug].manual = manual;
-    if (Plugs[plug].cause) free (Plugs[plug].cause);
-    Plugs[plug].cause = strdup(cause);
+    Plugs[plug].leased = 0; // Until the provider confirms.
+    PlugsText[plug].accepted = houselights_metrics_clock () / 1000;
+    PlugsText[plug].submitted = 0;
+    PlugsText[plug].acknowledged = 0;
+    if ((!PlugsText[plug].cause) || strcmp (PlugsText[plug].cause, cause)) {
+        if (PlugsText[plug].cause) free (PlugsText[plug].cause);
+        PlugsText[plug].cause = strdup(cause);
+    }
     if (Plugs[plug].status == 'i') Plugs[plug].status = 'a';
 
     if (pulse <= 0) {
@@ -480,20 +1588,21 @@ void houselights_plugs_set (const char *name, const char *state,
     } else {
         Plugs[plug].deadline = now + pulse;
     }
+    houselights_plugs_pending_add (plug);
 
     if (manual) { // Scheduled controls are logged by the scheduler
         if (pulse) {
             houselog_event ("PLUG", Plugs[plug].name, "CONTROLLED",
                             "%s FOR %d SECONDS (%s)",
-                            Plugs[plug].commanded, pulse, Plugs[plug].cause);
+                            Plugs[plug].commanded, pulse, PlugsText[plug].cause);
         } else {
             houselog_event ("PLUG", Plugs[plug].name, "CONTROLLED",
                             "%s (%s)",
-                            Plugs[plug].commanded, Plugs[plug].cause);
+                            Plugs[plug].commanded, PlugsText[plug].cause);
         }
     }
-    houselights_liveupdate ();
-    houselights_plugs_submit (plug, manual, cause);
+    houselights_plugs_changed (plug);
+    houselights_plugs_submit (plug);
 }
 
 void houselights_plugs_on
@@ -507,6 +1616,33 @@ void houselights_plugs_off (const char *name, int manual, const char *cause) {
     houselights_plugs_set (name, "off", 0, manual, cause);
 }
 
+void houselights_plugs_lease (const char *name, int duration, const char *cause) {
+
+    int plug = houselights_plugs_search (name);
+    if (plug < 0) return;
+
+    int pulse = (duration < PLUG_LEASE) ? duration : PLUG_LEASE;
+    int margin = (pulse < PLUG_LEASE_RENEW) ? pulse : PLUG_LEASE_RENEW;
+    time_t renew = time(0) + margin;
+
+    // Do not renew a lease that still holds for a while, or which
+    // renewal is already under way.
+    //
+    if (Plugs[plug].commanded && (!strcmp (Plugs[plug].commanded, "on"))) {
+        if (Plugs[plug].leased >= renew) return;
+        if (Plugs[plug].pending && (Plugs[plug].deadline >= renew)) return;
+    }
+    houselights_plugs_set (name, "on", pulse, 0, cause);
+}
+
+const char *houselights_plugs_state (const char *name) {
+
+    int plug = houselights_plugs_index_find (name, houselights_plugs_hash (name));
+    if (plug < 0) return 0;
+    if (!Plugs[plug].state[0]) return 0;
+    return Plugs[plug].state;
+}
+
 void houselights_plugs_periodic (time_t now) {
 
     static time_t starting = 0;
@@ -520,19 +1656,28 @@ void houselights_plugs_periodic (time_t now) {
     }
     if (starting == 0) starting = now;
 
+    houselights_plugs_timeout (houselights_metrics_clock () / 1000);
+    houselights_plugs_dispatch ();
+
     // Force a discovery every 2 seconds while a control is pending,
     // but not if the provider supports poll for changes and
     // not immediately after the control was issued.
     // (Poll for changes is more efficient than doing a discovery.)
     //
+    while (PlugsPendingCount > 0) {
+        int plug = PlugsPending[0];
+        if (houselights_plugs_expiry (plug) > now) break;
+        houselights_plugs_pending_remove (plug); // No longer pending.
+    }
     if (now >= latestdiscovery + 2) {
-        for (i = 0; i < PlugsCount; ++i) {
-            if (Plugs[i].parent < 0) continue; // pruned.
-            if (Providers[Plugs[i].parent].known > 0) continue; // Not needed.
-            if (houselights_plugs_pending(i)) {
+        for (i = 0; i < PlugsPendingCount; ++i) {
+            int plug = PlugsPending[i];
+            if (Plugs[plug].parent < 0) continue; // pruned.
+            if (Providers[Plugs[plug].parent].known > 0) continue; // Not needed.
+            if (houselights_plugs_pending(plug, now)) {
                 // Force a discovery ever 2 seconds, but not immediately
                 // after the command.
-                if (now > Plugs[i].requested) {
+                if (now > Plugs[plug].requested) {
                     latestdiscovery = 0;
                     break;
                 }
@@ -540,16 +1685,18 @@ void houselights_plugs_periodic (time_t now) {
         }
     }
 
-    // Poll for changes all known providers for change every second
-    // between two discoveries.
+    // Poll for changes all known providers between two discoveries,
+    // each on its own schedule.
     // (The discovery causes a full scan every minute--see later.)
     if (now < latestdiscovery + 60) {
+        long long clock = houselights_metrics_clock () / 1000;
         for (i = 0; i < ProvidersCount; ++i) {
             if (Providers[i].known <= 0) continue;
             if (now - Providers[i].responded >= 120) {
                 Providers[i].known = 0; // Erase stale knowledge.
                 continue; // Skip dead providers.
             }
+            if (!houselights_plugs_poll_due (Providers + i, clock)) continue;
             houselights_plugs_poll_server (i);
         }
     }
@@ -570,72 +1717,248 @@ void houselights_plugs_periodic (time_t now) {
     houselights_plugs_prune (now);
 }
 
-int houselights_plugs_status (char *buffer, int size) {
+static void houselights_plugs_servers (LightsOutput *out) {
 
     int i;
-    int cursor = 0;
     const char *prefix = "";
 
-    cursor = snprintf (buffer, size, "\"servers\":[");
-    if (cursor >= size) goto overflow;
-
+    houselights_output_append (out, "\"servers\":[");
     for (i = 0; i < ProvidersCount; ++i) {
-        cursor += snprintf (buffer+cursor, size-cursor,
-                            "%s\"%s\"", prefix, Providers[i].url);
-        if (cursor >= size) goto overflow;
+        houselights_output_format (out, "%s\"%s\"", prefix, Providers[i].url);
         prefix = ",";
     }
-    cursor += snprintf (buffer+cursor, size-cursor, "]");
-    if (cursor >= size) goto overflow;
+    houselights_output_append (out, "]");
+}
 
-    cursor += snprintf (buffer+cursor, size-cursor, ",\"plugs\":[");
-    if (cursor >= size) goto overflow;
-    prefix = "";
+static void houselights_plugs_format (LightsOutput *out,
+                                      int plug, const char *prefix) {
+
+    LightPlug *p = Plugs + plug;
+
+    houselights_output_format (out,
+                               "%s{\"name\":\"%s\",\"status\":\"%c\",\"state\":\"%s\"",
+                               prefix, p->name, p->status, p->state);
+    if (p->gear)
+        houselights_output_format (out, ",\"gear\":\"%s\"", p->gear);
+
+    if (p->parent >= 0) // Otherwise the URL is not yet known.
+        houselights_output_format (out, ",\"url\":\"%s\"",
+                                   Providers[p->parent].url);
+
+    if (p->deadline && p->commanded)
+        houselights_output_format (out, ",\"command\":\"%s\",\"expires\":%ld",
+                                   p->commanded, (long)(p->deadline));
+
+    if (p->mode)
+        houselights_output_format (out, ",\"mode\":\"%s\"", p->mode);
+
+    houselights_output_append (out, "}");
+}
+
+void houselights_plugs_status (LightsOutput *out) {
+
+    int i;
+    const char *prefix = "";
+
+    houselights_plugs_servers (out);
 
+    houselights_output_append (out, ",\"plugs\":[");
     for (i = 0; i < PlugsCount; ++i) {
-        char s[512];
-        char p[256];
-        char m[256];
-        char g[256];
 
         if (!Plugs[i].name) continue; // Ignore obsolete entries.
 
-        if (Plugs[i].url[0])
-            snprintf (s, sizeof(s), ",\"url\":\"%s\"", Plugs[i].url);
-        else
-            s[0] = 0; // URL is not yet known.
-
-        if (Plugs[i].deadline && Plugs[i].commanded)
-            snprintf (p, sizeof(p), ",\"command\":\"%s\",\"expires\":%ld",
-                      Plugs[i].commanded, (long)(Plugs[i].deadline));
-        else
-            p[0] = 0;
-
-        if (Plugs[i].mode)
-            snprintf (m, sizeof(m), ",\"mode\":\"%s\"", Plugs[i].mode);
-        else
-            m[0] = 0;
-
-        if (Plugs[i].gear)
-            snprintf (g, sizeof(g), ",\"gear\":\"%s\"", Plugs[i].gear);
-        else
-            g[0] = 0;
-
-        cursor += snprintf (buffer+cursor, size-cursor,
-                            "%s{\"name\":\"%s\",\"status\":\"%c\",\"state\":\"%s\"%s%s%s%s}",
-                            prefix, Plugs[i].name, Plugs[i].status, Plugs[i].state, g, s, p, m);
-        if (cursor >= size) goto overflow;
+        houselights_plugs_format (out, i, prefix);
         prefix = ",";
     }
+    houselights_output_append (out, "]");
+}
+
+int houselights_plugs_delta (LightsOutput *out, unsigned long known) {
+
+    static unsigned int Generation = 0;
+
+    int i;
+    int listed = 0;
+    const char *prefix = "";
 
-    cursor += snprintf (buffer+cursor, size-cursor, "]");
-    if (cursor >= size) goto overflow;
+    if ((!PlugsChangesInitialized) || (known < PlugsChangesFloor)) return -1;
+    if (known > houselights_livelatest ()) return -1; // Not from this run.
 
-    return cursor;
+    houselights_plugs_servers (out);
+    houselights_output_append (out, ",\"delta\":true,\"plugs\":[");
 
-overflow:
-    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
-    buffer[0] = 0;
+    // Walk the log from the most recent change back to the client's
+    // known version. The changes recorded with the known version itself
+    // are included, since they might have happened after the client got
+    // that version.
+    //
+    if (++Generation == 0) Generation = 1;
+    int live = PlugsCount - PlugsFreeCount; // Not counting the free slots.
+    int oldest = PlugsChangesCount - PLUG_CHANGE_LOG;
+    if (oldest < 0) oldest = 0;
+
+    for (i = PlugsChangesCount - 1; i >= oldest; --i) {
+        LightPlugChange *change = PlugsChanges + (i % PLUG_CHANGE_LOG);
+        if (change->version < known) break;
+        int plug = change->plug;
+        if (plug >= PlugsCount) continue;
+        if (!Plugs[plug].name) continue;
+        if (PlugsText[plug].reported == Generation) continue;
+        PlugsText[plug].reported = Generation;
+        if (++listed * 2 > live) return -1; // Not worth it.
+
+        houselights_plugs_format (out, plug, prefix);
+        prefix = ",";
+    }
+    houselights_output_append (out, "]");
     return 0;
 }
 
+void houselights_plugs_providers (LightsOutput *out) {
+
+    int i;
+    const char *prefix = "";
+
+    houselights_output_append (out, "\"providers\":[");
+
+    for (i = 0; i < ProvidersCount; ++i) {
+        LightProvider *provider = Providers + i;
+        houselights_output_format (out,
+                                   "%s{\"url\":\"%s\",\"batch\":%s,"
+                                       "\"known\":%lld,\"responded\":%lld,"
+                                       "\"interval\":%d,\"inflight\":%d,"
+                                       "\"requests\":%lld,\"failures\":%lld,"
+                                       "\"errors\":%lld}",
+                                   prefix, provider->url,
+                                   provider->batch?"true":"false",
+                                   provider->known,
+                                   (long long)(provider->responded),
+                                   provider->interval,
+                                   provider->inflight,
+                                   provider->requests,
+                                   provider->failures,
+                                   provider->errors);
+        prefix = ",";
+    }
+    houselights_output_append (out, "]");
+
+    long long average = 0;
+    if (RequestDispatched > 0) average = RequestWaitTotal / RequestDispatched;
+    houselights_output_format (out,
+                               ",\"scheduler\":{\"waiting\":%d,\"inflight\":%d,"
+                                   "\"dispatched\":%lld,\"timeouts\":%lld,"
+                                   "\"wait\":%lld,\"maxwait\":%d}",
+                               RequestWaitingCount, RequestInFlightCount,
+                               RequestDispatched, RequestTimeouts,
+                               average, RequestWaitMax);
+}
+
+void houselights_plugs_metrics (LightsOutput *out) {
+
+    int i;
+    const char *prefix = "";
+
+    houselights_output_format (out,
+                               "\"plugs\":{\"count\":%d,\"free\":%d,"
+                                   "\"pending\":%d,\"changes\":%d},",
+                               PlugsCount - PlugsFreeCount, PlugsFreeCount,
+                               PlugsPendingCount, PlugsChangesCount);
+
+    houselights_output_append (out, "\"providers\":[");
+    for (i = 0; i < ProvidersCount; ++i) {
+        LightProvider *provider = Providers + i;
+        houselights_output_format (out,
+                                   "%s{\"url\":\"%s\",\"polls\":%lld,"
+                                       "\"scans\":%lld,\"controls\":%lld,"
+                                       "\"batches\":%lld,\"failures\":%lld,"
+                                       "\"errors\":%lld}",
+                                   prefix, provider->url,
+                                   provider->polls, provider->scans,
+                                   provider->controls, provider->batches,
+                                   provider->failures, provider->errors);
+        prefix = ",";
+    }
+
+    houselights_output_append (out, "],\"http\":{");
+    prefix = "";
+    for (i = 0; i < HTTP_CODES; ++i) {
+        if (!PlugsHttpCodes[i].code) break;
+        houselights_output_format (out, "%s\"%d\":%lld", prefix,
+                                   PlugsHttpCodes[i].code,
+                                   PlugsHttpCodes[i].count);
+        prefix = ",";
+    }
+    houselights_output_format (out, "%s\"other\":%lld},", prefix, PlugsHttpOther);
+
+    houselights_metrics_format (out, "response", &PlugsResponseSize);
+    houselights_output_append (out, ",");
+    houselights_metrics_format (out, "parse", &PlugsParseTime);
+    houselights_output_format (out,
+                               ",\"tokens\":{\"size\":%d,\"grown\":%lld}",
+                               DiscoveryTokensSize, PlugsTokensGrown);
+}
+
+static void houselights_plugs_percentiles (LightsOutput *out,
+                                           const char *name,
+                                           const LightsHistogram *h) {
+    houselights_output_format (out,
+                               "\"%s\":{\"count\":%lld,\"p50\":%lld,"
+                                   "\"p90\":%lld,\"p99\":%lld,\"max\":%lld}",
+                               name, h->count,
+                               houselights_metrics_percentile (h, 50),
+                               houselights_metrics_percentile (h, 90),
+                               houselights_metrics_percentile (h, 99),
+                               h->max);
+}
+
+void houselights_plugs_latency (LightsOutput *out) {
+
+    int i;
+    const char *prefix = "";
+    static const char *causes[2] = {"SCHEDULE", "MANUAL"};
+
+    houselights_output_append (out, "\"latency\":{");
+    for (i = 0; i < 2; ++i) {
+        houselights_output_format (out, "%s\"%s\":{", prefix, causes[i]);
+        houselights_plugs_percentiles (out, "submitted", &(PlugsLatency[i].submitted));
+        houselights_output_append (out, ",");
+        houselights_plugs_percentiles (out, "acknowledged", &(PlugsLatency[i].acknowledged));
+        houselights_output_append (out, ",");
+        houselights_plugs_percentiles (out, "confirmed", &(PlugsLatency[i].confirmed));
+        houselights_output_append (out, "}");
+        prefix = ",";
+    }
+
+    houselights_output_append (out, "},\"providers\":[");
+    prefix = "";
+    for (i = 0; i < ProvidersCount; ++i) {
+        houselights_output_format (out, "%s{\"url\":\"%s\",",
+                                   prefix, Providers[i].url);
+        houselights_plugs_percentiles (out, "confirmed", &(Providers[i].latency));
+        houselights_output_append (out, "}");
+        prefix = ",";
+    }
+
+    houselights_output_append (out, "],\"slow\":[");
+    prefix = "";
+    int first = PlugsSlowCount - PLUG_TRACE_RING;
+    if (first < 0) first = 0;
+    for (i = PlugsSlowCount - 1; i >= first; --i) {
+        LightTrace *slow = PlugsSlow + (i % PLUG_TRACE_RING);
+        houselights_output_format (out,
+                                   "%s{\"name\":\"%s\",\"url\":\"%s\","
+                                       "\"cause\":\"%s\",\"accepted\":%lld,"
+                                       "\"submitted\":%d,\"acknowledged\":%d,"
+                                       "\"confirmed\":%d}",
+                                   prefix, slow->name,
+                                   (slow->provider >= 0) ?
+                                       Providers[slow->provider].url : "",
+                                   causes[slow->manual ? 1 : 0],
+                                   (long long)(slow->accepted),
+                                   slow->submitted,
+                                   slow->acknowledged,
+                                   slow->confirmed);
+        prefix = ",";
+    }
+    houselights_output_append (out, "]");
+}
@@ -28,8 +28,19 @@ void houselights_plugs_on
          (const char *name, int pulse, int manual, const char *cause);
 void houselights_plugs_off
          (const char *name, int manual, const char *cause);
+void houselights_plugs_lease
+         (const char *name, int duration, const char *cause);
+
+const char *houselights_plugs_state (const char *name);
+unsigned int houselights_plugs_hash (const char *name);
+
+void houselights_plugs_flush (void);
 
 void houselights_plugs_periodic (time_t now);
 
-int houselights_plugs_status (char *buffer, int size);
+void houselights_plugs_status (LightsOutput *out);
+int  houselights_plugs_delta (LightsOutput *out, unsigned long known);
+void houselights_plugs_providers (LightsOutput *out);
+void houselights_plugs_metrics (LightsOutput *out);
+void houselights_plugs_latency (LightsOutput *out);
 
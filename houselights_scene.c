@@ -0,0 +1,390 @@
+/* houseslights - A simple home web server for lighting control
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * houselights_scene.c - Control groups of lights at once.
+ *
+ * SYNOPSYS:
+ *
+ * This module handles named groups of plugs and named scenes. A group
+ * is a list of plugs that are controlled together. A scene is a list of
+ * controls (state and pulse), each for a plug or a group. Both are defined
+ * in the configuration, one item per group member and per scene control,
+ * in the same way as the schedules:
+ *
+ *    "groups":[{"name":"downstairs","device":"kitchen"},..]
+ *    "scenes":[{"name":"evening","device":"porch","state":"on","pulse":3600},
+ *              {"name":"evening","group":"downstairs","state":"off"},..]
+ *
+ * Each scene is compiled, when the configuration is loaded, into a flat
+ * list of plug controls where the groups are expanded and each plug
+ * appears only once (the last control wins). Applying a scene queues all
+ * these controls at once: they are then sent together, in one request
+ * per provider when the provider supports it.
+ *
+ * const char *houselights_scene_refresh (void);
+ *
+ *    Activate the last saved set of groups and scenes from the configuration.
+ *
+ * int houselights_scene_apply (const char *name, const char *cause);
+ *
+ *    Apply the specified scene. Return the number of plugs controlled,
+ *    or -1 if the scene does not exist.
+ *
+ * int houselights_scene_group (const char *name, const char *state,
+ *                              int pulse, const char *cause);
+ *
+ *    Set all the plugs of the specified group to the specified state.
+ *    Return the number of plugs controlled, or -1 if the group does not
+ *    exist or the state is not valid.
+ *
+ * void houselights_scene_status (LightsOutput *out);
+ *
+ *    A function that populates the groups and scenes in JSON, in the
+ *    configuration format.
+ *
+ * void houselights_scene_progress (LightsOutput *out);
+ *
+ *    A function that populates, in JSON, the list of scenes with how many
+ *    of their plugs have reported the state requested by the scene.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <echttp.h>
+
+#include "houselog.h"
+#include "houseconfig.h"
+
+#include "houselights.h"
+#include "houselights_output.h"
+#include "houselights_plugs.h"
+#include "houselights_scene.h"
+
+#define DEBUG if (echttp_isdebug()) printf
+
+typedef struct {
+    char *name;
+    char *device;
+} LightMember;
+
+static LightMember *Groups = 0;
+static int          GroupsCount = 0;
+static int          GroupsSize = 0;
+
+// The scene controls, as configured.
+//
+typedef struct {
+    char *name;
+    char *device; // Either a device or a group.
+    char *group;
+    char on;
+    int pulse;
+} LightControl;
+
+static LightControl *Controls = 0;
+static int           ControlsCount = 0;
+static int           ControlsSize = 0;
+
+// The compiled scenes: the plug controls of each scene are stored
+// consecutively in the targets table.
+//
+typedef struct {
+    const char *device;
+    char on;
+    int pulse;
+} LightTarget;
+
+typedef struct {
+    const char *name;
+    int first;
+    int count;
+    time_t applied;
+} LightScene;
+
+static LightTarget *Targets = 0;
+static int          TargetsCount = 0;
+static int          TargetsSize = 0;
+
+static LightScene *Scenes = 0;
+static int         ScenesCount = 0;
+static int         ScenesSize = 0;
+
+static int houselights_scene_state (const char *state) {
+    if (!state) return -1;
+    if (!strcmp (state, "on")) return 1;
+    if (!strcmp (state, "off")) return 0;
+    return -1;
+}
+
+static int houselights_scene_search (const char *name) {
+    int i;
+    for (i = 0; i < ScenesCount; ++i) {
+        if (!strcmp (Scenes[i].name, name)) return i;
+    }
+    return -1;
+}
+
+static void houselights_scene_target (LightScene *scene,
+                                      const char *device, char on, int pulse) {
+    int i;
+    LightTarget *target = 0;
+
+    for (i = scene->first; i < scene->first + scene->count; ++i) {
+        if (!strcmp (Targets[i].device, device)) {
+            target = Targets + i; // The last control wins.
+            break;
+        }
+    }
+    if (!target) {
+        if (TargetsCount >= TargetsSize) {
+            TargetsSize += 64;
+            Targets = realloc (Targets, TargetsSize * sizeof(LightTarget));
+        }
+        target = Targets + TargetsCount++;
+        target->device = device;
+        scene->count += 1;
+    }
+    target->on = on;
+    target->pulse = pulse;
+}
+
+static void houselights_scene_compile (void) {
+
+    int i, j, k;
+
+    TargetsCount = 0;
+    ScenesCount = 0;
+
+    for (i = 0; i < ControlsCount; ++i) {
+        if (houselights_scene_search (Controls[i].name) >= 0) continue;
+
+        if (ScenesCount >= ScenesSize) {
+            ScenesSize += 16;
+            Scenes = realloc (Scenes, ScenesSize * sizeof(LightScene));
+        }
+        LightScene *scene = Scenes + ScenesCount++;
+        scene->name = Controls[i].name;
+        scene->first = TargetsCount;
+        scene->count = 0;
+        scene->applied = 0;
+
+        for (j = i; j < ControlsCount; ++j) {
+            LightControl *control = Controls + j;
+            if (strcmp (control->name, scene->name)) continue;
+            if (control->device) {
+                houselights_scene_target
+                    (scene, control->device, control->on, control->pulse);
+                continue;
+            }
+            for (k = 0; k < GroupsCount; ++k) {
+                if (strcmp (Groups[k].name, control->group)) continue;
+                houselights_scene_target
+                    (scene, Groups[k].device, control->on, control->pulse);
+            }
+        }
+        DEBUG ("Scene %s: %d plugs\n", scene->name, scene->count);
+    }
+}
+
+const char *houselights_scene_refresh (void) {
+
+    int i;
+
+    for (i = 0; i < GroupsCount; ++i) {
+        free (Groups[i].name);
+        free (Groups[i].device);
+    }
+    GroupsCount = 0;
+    for (i = 0; i < ControlsCount; ++i) {
+        free (Controls[i].name);
+        if (Controls[i].device) free (Controls[i].device);
+        if (Controls[i].group) free (Controls[i].group);
+    }
+    ControlsCount = 0;
+
+    int groups = houseconfig_array (0, ".lights.groups");
+    if (groups > 0) {
+        int count = houseconfig_array_length (groups);
+        int *list = calloc (count, sizeof(int));
+        count = houseconfig_enumerate (groups, list, count);
+
+        for (i = 0; i < count; ++i) {
+            int item = houseconfig_object (list[i], 0);
+            if (item <= 0) continue;
+            const char *name = houseconfig_string (item, ".name");
+            const char *device = houseconfig_string (item, ".device");
+            if (!name || !device) continue;
+
+            if (GroupsCount >= GroupsSize) {
+                GroupsSize += 32;
+                Groups = realloc (Groups, GroupsSize * sizeof(LightMember));
+            }
+            Groups[GroupsCount].name = strdup (name);
+            Groups[GroupsCount].device = strdup (device);
+            GroupsCount += 1;
+        }
+        free (list);
+    }
+
+    int scenes = houseconfig_array (0, ".lights.scenes");
+    if (scenes > 0) {
+        int count = houseconfig_array_length (scenes);
+        int *list = calloc (count, sizeof(int));
+        count = houseconfig_enumerate (scenes, list, count);
+
+        for (i = 0; i < count; ++i) {
+            int item = houseconfig_object (list[i], 0);
+            if (item <= 0) continue;
+            const char *name = houseconfig_string (item, ".name");
+            const char *device = houseconfig_string (item, ".device");
+            const char *group = houseconfig_string (item, ".group");
+            int on = houselights_scene_state (houseconfig_string (item, ".state"));
+            if (!name || (!device && !group) || (on < 0)) continue;
+
+            if (ControlsCount >= ControlsSize) {
+                ControlsSize += 32;
+                Controls = realloc (Controls, ControlsSize * sizeof(LightControl));
+            }
+            LightControl *control = Controls + ControlsCount++;
+            control->name = strdup (name);
+            control->device = device ? strdup (device) : 0;
+            control->group = device ? 0 : strdup (group);
+            control->on = on;
+            control->pulse = on ? houseconfig_integer (item, ".pulse") : 0;
+            if (control->pulse < 0) control->pulse = 0;
+        }
+        free (list);
+    }
+    houselights_scene_compile ();
+    return 0;
+}
+
+static void houselights_scene_control (const char *device, char on, int pulse,
+                                       const char *cause) {
+    if (on)
+        houselights_plugs_on (device, pulse, 1, cause);
+    else
+        houselights_plugs_off (device, 1, cause);
+}
+
+int houselights_scene_apply (const char *name, const char *cause) {
+
+    int i;
+    int index = houselights_scene_search (name);
+    if (index < 0) return -1;
+
+    LightScene *scene = Scenes + index;
+    char buffer[128];
+    if (!cause) {
+        snprintf (buffer, sizeof(buffer), "SCENE %s", scene->name);
+        cause = buffer;
+    }
+    houselog_event ("SCENE", scene->name, "APPLIED",
+                    "%d PLUGS (%s)", scene->count, cause);
+
+    for (i = scene->first; i < scene->first + scene->count; ++i) {
+        houselights_scene_control
+            (Targets[i].device, Targets[i].on, Targets[i].pulse, cause);
+    }
+    houselights_plugs_flush (); // All the controls in one go.
+    scene->applied = time(0);
+    return scene->count;
+}
+
+int houselights_scene_group (const char *name, const char *state,
+                             int pulse, const char *cause) {
+
+    int i;
+    int count = 0;
+    int on = houselights_scene_state (state);
+    if (on < 0) return -1;
+
+    char buffer[128];
+    if (!cause) {
+        snprintf (buffer, sizeof(buffer), "GROUP %s", name);
+        cause = buffer;
+    }
+    for (i = 0; i < GroupsCount; ++i) {
+        if (strcmp (Groups[i].name, name)) continue;
+        houselights_scene_control (Groups[i].device, on, pulse, cause);
+        count += 1;
+    }
+    if (!count) return -1;
+
+    houselights_plugs_flush ();
+    return count;
+}
+
+void houselights_scene_status (LightsOutput *out) {
+
+    int i;
+    const char *prefix = "";
+
+    houselights_output_append (out, "\"groups\":[");
+    for (i = 0; i < GroupsCount; ++i) {
+        houselights_output_format (out,
+                                   "%s{\"name\":\"%s\",\"device\":\"%s\"}",
+                                   prefix, Groups[i].name, Groups[i].device);
+        prefix = ",";
+    }
+    houselights_output_append (out, "],\"scenes\":[");
+    prefix = "";
+    for (i = 0; i < ControlsCount; ++i) {
+        LightControl *control = Controls + i;
+        houselights_output_format (out,
+                                   "%s{\"name\":\"%s\",\"%s\":\"%s\""
+                                       ",\"state\":\"%s\"",
+                                   prefix, control->name,
+                                   control->device ? "device" : "group",
+                                   control->device ? control->device : control->group,
+                                   control->on ? "on" : "off");
+        if (control->pulse)
+            houselights_output_format (out, ",\"pulse\":%d", control->pulse);
+        houselights_output_append (out, "}");
+        prefix = ",";
+    }
+    houselights_output_append (out, "]");
+}
+
+void houselights_scene_progress (LightsOutput *out) {
+
+    int i, j;
+    const char *prefix = "";
+
+    houselights_output_append (out, "\"scenes\":[");
+    for (i = 0; i < ScenesCount; ++i) {
+        LightScene *scene = Scenes + i;
+        int confirmed = 0;
+        for (j = scene->first; j < scene->first + scene->count; ++j) {
+            const char *state = houselights_plugs_state (Targets[j].device);
+            if (state && (!strcmp (state, Targets[j].on ? "on" : "off")))
+                confirmed += 1;
+        }
+        houselights_output_format (out,
+                                   "%s{\"name\":\"%s\",\"applied\":%lld,"
+                                       "\"plugs\":%d,\"confirmed\":%d}",
+                                   prefix, scene->name, (long long)(scene->applied),
+                                   scene->count, confirmed);
+        prefix = ",";
+    }
+    houselights_output_append (out, "]");
+}
@@ -0,0 +1,31 @@
+/* houseslights - A simple home web server for lighting control
+ *
+ * Copyright 2025, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * houselights_scene.h - Control groups of lights at once.
+ */
+
+const char *houselights_scene_refresh (void);
+
+int houselights_scene_apply (const char *name, const char *cause);
+int houselights_scene_group (const char *name, const char *state,
+                             int pulse, const char *cause);
+
+void houselights_scene_status (LightsOutput *out);
+void houselights_scene_progress (LightsOutput *out);
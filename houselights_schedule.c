@@ -23,6 +23,8 @@
  * SYNOPSYS:
  *
  * This module handles scheduling lighting plugs at specific intervals.
+ * When several schedules apply to the same plug, their intervals are
+ * merged so that the plug is controlled once, over one active window.
  *
  * const char *houselights_schedule_refresh (void);
  *
@@ -42,23 +44,46 @@
  *        hh | hh:mm | hh:-mm | sunrise:[-]mm | sunset:[-]mm
  *    If the on time is less than the off time, then both are for the same day.
  *    If the off time is less than the on time, then the off time is for the
- *    next day,
+ *    next day. An interval longer than 12 hours is limited to 12 hours,
+ *    unless the on or off time is based on sunrise or sunset.
  *    The days value is a bit map: Sunday is bit 0 and Saturday is bit 6.
  *
  * void houselights_schedule_delete (const char *id);
  *
+ * const char *houselights_schedule_bulk (const char *action, const char *data);
+ *
+ *    Apply a list of changes, provided as a JSON array. The action is
+ *    "add" or "replace" (the array lists schedules, as objects with the
+ *    device, on, off and days items), or "delete" (the array lists schedule
+ *    IDs). The whole list is validated first, and nothing is changed if
+ *    any item is invalid. Return an error message, or 0 on success.
+ *
  * void houselights_schedule_periodic (time_t now);
  *
- * int houselights_schedule_status (char *buffer, int size);
+ *    Process the schedule transitions that are due. This does nothing
+ *    when no transition is due, and should be called every second.
+ *
+ * void houselights_schedule_status (LightsOutput *out);
  *
  *    A function that populates a complete status in JSON.
  *
+ * void houselights_schedule_timeline (LightsOutput *out, int days, time_t now);
+ *
+ *    A function that populates, in JSON, the merged on/off intervals of
+ *    each plug, for the specified number of days starting today. This
+ *    includes the intervals that started yesterday and are still active.
+ *
+ * void houselights_schedule_metrics (LightsOutput *out);
+ *
+ *    A function that populates the runtime metrics of this module in JSON.
+ *
  */
 
 #include <sys/time.h>
 
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <stdio.h>
 
 #include <echttp.h>
@@ -69,6 +94,8 @@
 #include "housediscover.h"
 #include "housealmanac.h"
 
+#include "houselights.h"
+#include "houselights_output.h"
 #include "houselights_plugs.h"
 #include "houselights_schedule.h"
 
@@ -80,6 +107,11 @@ typedef struct {
     char base;
 } LightTime;
 
+typedef struct {
+    time_t start;
+    time_t end;
+} LightInterval;
+
 typedef struct {
     int id;
     char *plug;
@@ -87,16 +119,101 @@ typedef struct {
     LightTime off;
     int days;
     char state; // i: idle, a: active.
+    int window; // Index of the plug's window.
+    int count;
+    LightInterval intervals[3]; // Started yesterday, today or tomorrow.
 } LightSchedule;
 
-#define MAX_SCHEDULES 256
-
 static int ScheduleDisabled = 1;
 
-static LightSchedule Schedules[MAX_SCHEDULES];
-static int           SchedulesCount = 0;
+// The schedules are stored in a table that grows as needed, where the
+// slots of deleted schedules are reused. A schedule is found from its ID
+// using a hash index (open addressing, linear probing), and each plug's
+// window lists the schedules that apply to this plug.
+//
+static LightSchedule *Schedules = 0;
+static int            SchedulesSize = 0;
+static int            SchedulesCount = 0; // Including the free slots.
+
+static int *SchedulesFree = 0;
+static int  SchedulesFreeCount = 0;
+
+static int *SchedulesIndex = 0; // Slot + 1, 0 if empty.
+static int  SchedulesIndexSize = 0;
+static int  SchedulesIndexCount = 0;
+
+static int ScheduleNextId = 0;
 
 static int LightsRandom = 0; // Random adjustment to make it realistic.
+static time_t LightsRandomDay = 0; // The day LightsRandom was drawn for.
+
+// The schedules are compiled into absolute time intervals, for the
+// occurrences that start yesterday, today and tomorrow. This way the
+// intervals that span midnight are handled the same as the others.
+// The intervals are then merged into one set per plug, where overlapping
+// or adjacent intervals are combined. This way each plug gets at most
+// one control per evaluation, and a single active window in the event log.
+//
+// The start and end of each interval are transitions kept in a min-heap,
+// so that each transition is processed at the second it is due, and
+// nothing is evaluated in between. An active window is re-evaluated every
+// SCHEDULE_RENEW seconds, to maintain the lease on its plug.
+//
+// Everything is recompiled when the schedules change, at midnight and
+// when the almanac changes. The random adjustment is chosen at that time.
+//
+typedef struct {
+    char *plug;
+    unsigned int hash;
+    int *rules; // The schedules for this plug.
+    int rulescount;
+    int rulessize;
+    int count;
+    int size;
+    LightInterval *intervals; // Sorted by start time, not overlapping.
+    time_t active; // End of the current active window, 0 if inactive.
+} LightWindow;
+
+static LightWindow *Windows = 0;
+static int          WindowsCount = 0;
+static int          WindowsSize = 0;
+
+static int *WindowsIndex = 0; // Window + 1, 0 if empty.
+static int  WindowsIndexSize = 0;
+
+#define SCHEDULE_RULE    1
+#define SCHEDULE_WINDOW  2
+#define SCHEDULE_COMPILE 3
+
+#define SCHEDULE_RENEW  30 // seconds.
+
+#define SCHEDULE_MAX_DURATION (12*60*60) // Longer is most likely a mistake.
+
+typedef struct {
+    time_t when;
+    int kind;
+    int index;
+} LightTransition;
+
+static LightTransition *Transitions = 0;
+static int              TransitionsCount = 0;
+static int              TransitionsSize = 0;
+
+static int    ScheduleCompiled = 0;
+static time_t CompiledSunset = 0;
+static time_t CompiledSunrise = 0;
+
+// The timeline is computed on demand, and kept until the schedules are
+// compiled again, i.e. when the configuration or the almanac change, and
+// at midnight.
+//
+#define TIMELINE_MAX_DAYS 366
+
+static LightsOutput   Timeline;
+static int            TimelineValid = 0;
+static int            TimelineDays = 0;
+static LightInterval *TimelineIntervals = 0;
+static int            TimelineSize = 0;
 
 
 static void houselights_schedule_import (const char *ascii, LightTime *t) {
@@ -125,19 +242,160 @@ static void houselights_schedule_import (const char *ascii, LightTime *t) {
     if (t->hour < 0 || t->hour > 23) t->hour = 0;
 }
 
-static time_t houselights_schedule_adjust (time_t base, LightTime *t, int ready) {
+// Return the local time of day (in seconds) of an almanac event.
+//
+static int houselights_schedule_timeofday (time_t t) {
+    struct tm local = *localtime (&t);
+    return (local.tm_hour * 3600) + (local.tm_min * 60) + local.tm_sec;
+}
+
+// The schedules are evaluated against a calendar of consecutive days,
+// which records the local midnight of each day and its length. Most days
+// are exactly 24 hours long, and a wall clock time is then a simple offset
+// from midnight. Otherwise mktime() accounts for the DST change.
+//
+// The almanac only provides tonight's sunset and sunrise: their time
+// of day is used for the other days, which is close enough.
+//
+typedef struct {
+    struct tm local; // Midnight, normalized.
+    time_t midnight;
+    int length;
+} LightDay;
+
+static int ScheduleReady = 0;
+static int ScheduleSunrise = 0;
+static int ScheduleSunset = 0;
+
+static void houselights_schedule_calendar (LightDay *days, int count,
+                                           time_t now, int offset) {
+    int i;
+    struct tm today = *localtime (&now);
+    today.tm_hour = today.tm_min = today.tm_sec = 0;
+
+    ScheduleReady = housealmanac_tonight_ready();
+    if (ScheduleReady) {
+        ScheduleSunrise =
+            houselights_schedule_timeofday (housealmanac_tonight_sunrise());
+        ScheduleSunset =
+            houselights_schedule_timeofday (housealmanac_tonight_sunset());
+    }
+
+    time_t next = 0;
+    for (i = 0; i <= count; ++i) {
+        struct tm local = today;
+        local.tm_mday += offset + i;
+        local.tm_isdst = -1;
+        time_t midnight = mktime (&local);
+        if (i > 0) days[i-1].length = (int)(midnight - next);
+        if (i < count) {
+            days[i].local = local;
+            days[i].midnight = midnight;
+        }
+        next = midnight;
+    }
+}
+
+// Return the absolute time of a schedule time on the specified day,
+// or 0 if this time cannot be computed.
+//
+static time_t houselights_schedule_time (const LightDay *day,
+                                         const LightTime *t) {
 
     // It is OK if minutes < 0. For example 12:-20 is "20mn before 12".
-    int delta = (t->hour * 3600) + (t->minutes * 60) + LightsRandom;
+    int delta = (t->hour * 3600) + (t->minutes * 60);
+    int seconds;
 
     if (t->base == '-') {
-        if (!ready) return 0;
-        return housealmanac_tonight_sunrise() - delta;
+        if (!ScheduleReady) return 0;
+        seconds = ScheduleSunrise - delta;
     } else if (t->base == '+') {
-        if (!ready) return 0;
-        return housealmanac_tonight_sunset() + delta;
+        if (!ScheduleReady) return 0;
+        seconds = ScheduleSunset + delta;
+    } else {
+        seconds = delta;
+    }
+    seconds += LightsRandom;
+
+    if ((day->length == 24 * 3600) && (seconds >= 0) && (seconds < day->length))
+        return day->midnight + seconds;
+
+    struct tm local = day->local;
+    local.tm_sec = seconds;
+    local.tm_isdst = -1;
+    return mktime (&local);
+}
+
+// Compute the interval of a schedule that starts on the specified day.
+// The calendar must include the next day. Return 0 if there is none,
+// 2 if the interval was cut down to SCHEDULE_MAX_DURATION, 1 otherwise.
+// The limit does not apply when the on or off time is based on sunrise
+// or sunset: a sunset to sunrise interval is long in winter.
+//
+static int houselights_schedule_occurrence (const LightSchedule *schedule,
+                                            const LightDay *day,
+                                            LightInterval *interval) {
+
+    if (!(schedule->days & (1 << day->local.tm_wday))) return 0;
+
+    time_t on = houselights_schedule_time (day, &(schedule->on));
+    time_t off = houselights_schedule_time (day, &(schedule->off));
+    if ((on == 0) || (off == 0)) return 0; // Cannot adjust this interval.
+
+    // If the off time is before the on time, it is for the next day.
+    if (off <= on) off = houselights_schedule_time (day + 1, &(schedule->off));
+
+    interval->start = on;
+    interval->end = off;
+    if (schedule->on.base || schedule->off.base) return 1;
+    if (off - on <= SCHEDULE_MAX_DURATION) return 1;
+
+    interval->end = on + SCHEDULE_MAX_DURATION;
+    return 2;
+}
+
+// Check the syntax of a schedule time: [+|-]hh[:[-]mm]
+//
+static int houselights_schedule_valid (const char *ascii) {
+
+    if (!ascii) return 0;
+    if ((*ascii == '+') || (*ascii == '-')) ascii += 1;
+
+    int digits;
+    int hour = 0;
+    for (digits = 0; isdigit(*ascii); ++digits) hour = (hour * 10) + *(ascii++) - '0';
+    if ((digits < 1) || (digits > 2) || (hour > 23)) return 0;
+
+    if (*ascii == 0) return 1;
+    if (*(ascii++) != ':') return 0;
+
+    int sign = 1;
+    if (*ascii == '-') {
+        sign = -1;
+        ascii += 1;
+    }
+    int minutes = 0;
+    for (digits = 0; isdigit(*ascii); ++digits) minutes = (minutes * 10) + *(ascii++) - '0';
+    if ((digits < 1) || (digits > 2) || (*ascii != 0)) return 0;
+    minutes *= sign;
+    return (minutes >= -30) && (minutes < 60);
+}
+
+static void houselights_schedule_clear (void) {
+
+    int i;
+    for (i = 0; i < SchedulesCount; ++i) {
+        if (Schedules[i].plug) free (Schedules[i].plug);
+        Schedules[i].plug = 0;
+        Schedules[i].id = 0;
     }
-    return base + delta;
+    SchedulesCount = 0;
+    SchedulesFreeCount = 0;
+    if (SchedulesIndex)
+        memset (SchedulesIndex, 0, SchedulesIndexSize * sizeof(int));
+    SchedulesIndexCount = 0;
+    for (i = 0; i < WindowsCount; ++i) Windows[i].rulescount = 0;
+    ScheduleCompiled = 0;
 }
 
 const char *houselights_schedule_refresh (void) {
@@ -153,21 +411,15 @@ const char *houselights_schedule_refresh (void) {
     }
     if (echttp_isdebug()) printf ("Schedule disabled: %s (%s)\n", ScheduleDisabled?"true":"false", mode?"configured":"default");
 
-    for (i = 0; i < SchedulesCount; ++i) {
-        if (Schedules[i].plug) free (Schedules[i].plug);
-        Schedules[i].plug = 0;
-    }
+    houselights_schedule_clear ();
 
     if (schedules > 0) {
         int count = houseconfig_array_length (schedules);
         if (echttp_isdebug()) printf ("Schedule: %d entries\n", count);
-        if (count > MAX_SCHEDULES) count = MAX_SCHEDULES;
 
         int *list = calloc (count, sizeof(int));
         count = houseconfig_enumerate (schedules, list, count);
 
-        SchedulesCount = 0;
-
         for (i = 0; i < count; ++i) {
             int item = houseconfig_object (list[i], 0);
             if (item <= 0) continue;
@@ -187,6 +439,7 @@ const char *houselights_schedule_refresh (void) {
 
 void houselights_schedule_enable (void) {
     ScheduleDisabled = 0;
+    ScheduleCompiled = 0;
 }
 
 void houselights_schedule_disable (void) {
@@ -196,155 +449,627 @@ void houselights_schedule_disable (void) {
     int i;
     for (i = 0; i < SchedulesCount; ++i) {
         if (Schedules[i].state != 'i') {
-            houselog_event ("PLUG", Schedules[i].plug,
-                            "INACTIVE", "SCHEDULE DISABLED");
             Schedules[i].state = 'i';
+            houselights_scheduleupdate ();
+        }
+    }
+    for (i = 0; i < WindowsCount; ++i) {
+        if (Windows[i].active) {
+            houselog_event ("PLUG", Windows[i].plug,
+                            "INACTIVE", "SCHEDULE DISABLED");
+            Windows[i].active = 0;
+        }
+    }
+    ScheduleCompiled = 0; // Re-evaluate everything when enabled.
+}
+
+
+static int houselights_schedule_home (int id, int mask) {
+    return ((unsigned int)id * 2654435761u) & mask;
+}
+
+static int houselights_schedule_find (int id) {
+
+    if (SchedulesIndexSize <= 0) return -1;
+
+    int mask = SchedulesIndexSize - 1;
+    int i = houselights_schedule_home (id, mask);
+    while (SchedulesIndex[i]) {
+        int slot = SchedulesIndex[i] - 1;
+        if (Schedules[slot].id == id) return slot;
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+static void houselights_schedule_index_add (int slot) {
+    int mask = SchedulesIndexSize - 1;
+    int i = houselights_schedule_home (Schedules[slot].id, mask);
+    while (SchedulesIndex[i]) i = (i + 1) & mask;
+    SchedulesIndex[i] = slot + 1;
+}
+
+static void houselights_schedule_index_insert (int slot) {
+
+    if ((SchedulesIndexCount + 1) * 2 > SchedulesIndexSize) {
+        // Grow the index, keeping the load factor under 0.5.
+        int i;
+        SchedulesIndexSize = SchedulesIndexSize ? SchedulesIndexSize * 2 : 64;
+        free (SchedulesIndex);
+        SchedulesIndex = calloc (SchedulesIndexSize, sizeof(int));
+        for (i = 0; i < SchedulesCount; ++i) {
+            if (Schedules[i].id && (i != slot))
+                houselights_schedule_index_add (i);
+        }
+    }
+    houselights_schedule_index_add (slot);
+    SchedulesIndexCount += 1;
+}
+
+static void houselights_schedule_index_remove (int slot) {
+
+    int mask = SchedulesIndexSize - 1;
+    int i = houselights_schedule_home (Schedules[slot].id, mask);
+    while (SchedulesIndex[i] != slot + 1) {
+        if (!SchedulesIndex[i]) return; // Not indexed.
+        i = (i + 1) & mask;
+    }
+    SchedulesIndex[i] = 0;
+    SchedulesIndexCount -= 1;
+
+    // Shift back the entries that follow, so that no search stops early.
+    int j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!SchedulesIndex[j]) break;
+        int home =
+            houselights_schedule_home (Schedules[SchedulesIndex[j]-1].id, mask);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            SchedulesIndex[i] = SchedulesIndex[j];
+            SchedulesIndex[j] = 0;
+            i = j;
+        }
+    }
+}
+
+static void houselights_schedule_window_add (int window) {
+    int mask = WindowsIndexSize - 1;
+    int i = Windows[window].hash & mask;
+    while (WindowsIndex[i]) i = (i + 1) & mask;
+    WindowsIndex[i] = window + 1;
+}
+
+// Rebuild the whole windows index. This is needed only when the index
+// grows, or when windows were removed (and the others moved).
+//
+static void houselights_schedule_window_index (void) {
+
+    int i;
+
+    if (WindowsCount * 2 >= WindowsIndexSize) {
+        while (WindowsCount * 2 >= WindowsIndexSize)
+            WindowsIndexSize = WindowsIndexSize ? WindowsIndexSize * 2 : 64;
+        WindowsIndex = realloc (WindowsIndex, WindowsIndexSize * sizeof(int));
+    }
+    memset (WindowsIndex, 0, WindowsIndexSize * sizeof(int));
+
+    for (i = 0; i < WindowsCount; ++i) houselights_schedule_window_add (i);
+}
+
+static int houselights_schedule_window (const char *plug) {
+
+    unsigned int hash = houselights_plugs_hash (plug);
+
+    if (WindowsIndexSize > 0) {
+        int mask = WindowsIndexSize - 1;
+        int i = hash & mask;
+        while (WindowsIndex[i]) {
+            LightWindow *window = Windows + WindowsIndex[i] - 1;
+            if ((window->hash == hash) && (!strcmp (window->plug, plug)))
+                return WindowsIndex[i] - 1;
+            i = (i + 1) & mask;
         }
     }
+
+    if (WindowsCount >= WindowsSize) {
+        WindowsSize += 32;
+        Windows = realloc (Windows, WindowsSize * sizeof(LightWindow));
+    }
+    LightWindow *window = Windows + WindowsCount++;
+    window->plug = strdup (plug);
+    window->hash = hash;
+    window->rules = 0;
+    window->rulescount = 0;
+    window->rulessize = 0;
+    window->count = 0;
+    window->size = 0;
+    window->intervals = 0;
+    window->active = 0;
+    if (WindowsCount * 2 >= WindowsIndexSize)
+        houselights_schedule_window_index (); // Grow the index.
+    else
+        houselights_schedule_window_add (WindowsCount - 1);
+    return WindowsCount - 1;
 }
 
+static void houselights_schedule_attach (int slot) {
+
+    int index = houselights_schedule_window (Schedules[slot].plug);
+    LightWindow *window = Windows + index;
+
+    if (window->rulescount >= window->rulessize) {
+        window->rulessize += 4;
+        window->rules = realloc (window->rules, window->rulessize * sizeof(int));
+    }
+    window->rules[window->rulescount++] = slot;
+    Schedules[slot].window = index;
+}
+
+static void houselights_schedule_detach (int slot) {
+
+    int i;
+    LightWindow *window = Windows + Schedules[slot].window;
+
+    for (i = 0; i < window->rulescount; ++i) {
+        if (window->rules[i] == slot) {
+            window->rules[i] = window->rules[--window->rulescount];
+            break;
+        }
+    }
+}
 
 void houselights_schedule_add (const char *plug,
                                const char *on, const char *off, int days) {
-    if (SchedulesCount < MAX_SCHEDULES) {
-        Schedules[SchedulesCount].id =
-            0x1000000 + (time(0) & 0xffff00) + SchedulesCount;
-        Schedules[SchedulesCount].plug = strdup(plug);
-        houselights_schedule_import (on, &(Schedules[SchedulesCount].on));
-        houselights_schedule_import (off, &(Schedules[SchedulesCount].off));
-        Schedules[SchedulesCount].days = days;
-        Schedules[SchedulesCount].state = 'i';
-        SchedulesCount += 1;
+    int slot;
+
+    if (SchedulesFreeCount > 0) {
+        slot = SchedulesFree[--SchedulesFreeCount];
+    } else {
+        if (SchedulesCount >= SchedulesSize) {
+            SchedulesSize = SchedulesSize ? SchedulesSize * 2 : 64;
+            Schedules = realloc (Schedules, SchedulesSize * sizeof(LightSchedule));
+            SchedulesFree = realloc (SchedulesFree, SchedulesSize * sizeof(int));
+        }
+        slot = SchedulesCount++;
     }
+    LightSchedule *schedule = Schedules + slot;
+
+    if (!ScheduleNextId) ScheduleNextId = 0x1000000 + (time(0) & 0xffff00);
+    do {
+        schedule->id = 0; // Do not match itself.
+        int id = ScheduleNextId++;
+        if (houselights_schedule_find (id) < 0) schedule->id = id;
+    } while (!schedule->id);
+
+    schedule->plug = strdup(plug);
+    houselights_schedule_import (on, &(schedule->on));
+    houselights_schedule_import (off, &(schedule->off));
+    schedule->days = days;
+    schedule->state = 'i';
+    schedule->count = 0;
+
+    houselights_schedule_index_insert (slot);
+    houselights_schedule_attach (slot);
+    ScheduleCompiled = 0;
 }
 
 void houselights_schedule_delete (const char *identifier) {
 
+    int slot = houselights_schedule_find (atoi (identifier));
+    if (slot < 0) return;
+
+    houselights_schedule_detach (slot);
+    houselights_schedule_index_remove (slot);
+    free (Schedules[slot].plug);
+    Schedules[slot].plug = 0;
+    Schedules[slot].id = 0;
+    Schedules[slot].state = 'i';
+    Schedules[slot].count = 0;
+    ScheduleCompiled = 0;
+
+    if (slot == SchedulesCount - 1) {
+        SchedulesCount -= 1;
+    } else {
+        SchedulesFree[SchedulesFreeCount++] = slot;
+    }
+}
+
+// The ID of an item of a bulk delete: either the ID itself, or an object
+// with an id item.
+//
+static int houselights_schedule_bulk_id (const ParserToken *token) {
+
+    switch (token->type) {
+        case PARSER_INTEGER:
+            return (int)(token->value.integer);
+        case PARSER_STRING:
+            return atoi (token->value.string);
+        case PARSER_OBJECT: {
+            int id = echttp_json_search (token, ".id");
+            if (id <= 0) return 0;
+            return houselights_schedule_bulk_id (token + id);
+        }
+    }
+    return 0;
+}
+
+const char *houselights_schedule_bulk (const char *action, const char *data) {
+
+    static char error[128];
     int i;
-    int id = atoi (identifier);
-    for (i = 0; i < SchedulesCount; ++i) {
-        if (Schedules[i].id != id) continue;
-        if (Schedules[i].plug) free(Schedules[i].plug);
-        Schedules[i].plug = 0;
-        Schedules[i].id = 0;
+
+    int replace = 0;
+    int delete = 0;
+    if (!action || !strcmp (action, "add")) {
+        // Default action.
+    } else if (!strcmp (action, "replace")) {
+        replace = 1;
+    } else if (!strcmp (action, "delete")) {
+        delete = 1;
+    } else {
+        return "invalid action";
+    }
+    if (!data) return "no data";
+
+    int count = echttp_json_estimate (data);
+    if (count <= 0) return "no data";
+
+    char *json = strdup (data);
+    ParserToken *tokens = calloc (count, sizeof(ParserToken));
+    int *list = 0;
+    const char *status = echttp_json_parse (json, tokens, &count);
+    if (status) goto done;
+
+    if ((count <= 0) || (tokens[0].type != PARSER_ARRAY)) {
+        status = "not a JSON array";
+        goto done;
+    }
+    int n = tokens[0].length;
+    list = calloc (n + 1, sizeof(int));
+    status = echttp_json_enumerate (tokens, list, n);
+    if (status) goto done;
+
+    // Validate the complete list before changing anything.
+    //
+    for (i = 0; i < n; ++i) {
+        ParserToken *item = tokens + list[i];
+        if (delete) {
+            if (houselights_schedule_find
+                    (houselights_schedule_bulk_id (item)) < 0) {
+                snprintf (error, sizeof(error), "item %d: unknown schedule", i);
+                status = error;
+                goto done;
+            }
+            continue;
+        }
+        if (item->type != PARSER_OBJECT) {
+            snprintf (error, sizeof(error), "item %d: not an object", i);
+            status = error;
+            goto done;
+        }
+        int device = echttp_json_search (item, ".device");
+        int on = echttp_json_search (item, ".on");
+        int off = echttp_json_search (item, ".off");
+        int days = echttp_json_search (item, ".days");
+        if ((device <= 0) || (item[device].type != PARSER_STRING) ||
+            (item[device].value.string[0] == 0)) {
+            snprintf (error, sizeof(error), "item %d: invalid device", i);
+        } else if ((on <= 0) || (item[on].type != PARSER_STRING) ||
+                   (!houselights_schedule_valid (item[on].value.string))) {
+            snprintf (error, sizeof(error), "item %d: invalid on time", i);
+        } else if ((off <= 0) || (item[off].type != PARSER_STRING) ||
+                   (!houselights_schedule_valid (item[off].value.string))) {
+            snprintf (error, sizeof(error), "item %d: invalid off time", i);
+        } else if ((days > 0) &&
+                   ((item[days].type != PARSER_INTEGER) ||
+                    (item[days].value.integer < 0) ||
+                    (item[days].value.integer > 0x7f))) {
+            snprintf (error, sizeof(error), "item %d: invalid days", i);
+        } else {
+            continue;
+        }
+        status = error;
+        goto done;
+    }
+
+    // Now apply the changes.
+    //
+    if (replace) houselights_schedule_clear ();
+
+    for (i = 0; i < n; ++i) {
+        ParserToken *item = tokens + list[i];
+        if (delete) {
+            char id[16];
+            snprintf (id, sizeof(id), "%d", houselights_schedule_bulk_id (item));
+            houselights_schedule_delete (id);
+            continue;
+        }
+        int days = echttp_json_search (item, ".days");
+        houselights_schedule_add
+            (item[echttp_json_search (item, ".device")].value.string,
+             item[echttp_json_search (item, ".on")].value.string,
+             item[echttp_json_search (item, ".off")].value.string,
+             ((days > 0) && item[days].value.integer) ?
+                 (int)(item[days].value.integer) : 0x7f);
     }
-    for (i = SchedulesCount - 1; i >= 0; --i) {
-        if (Schedules[i].id) break;
-        SchedulesCount = i;
+
+done:
+    if (list) free (list);
+    free (tokens);
+    free (json);
+    return status;
+}
+
+static int houselights_schedule_earlier (const void *a, const void *b) {
+    time_t start_a = ((const LightInterval *)a)->start;
+    time_t start_b = ((const LightInterval *)b)->start;
+    if (start_a < start_b) return -1;
+    if (start_a > start_b) return 1;
+    return 0;
+}
+
+static void houselights_schedule_push (time_t when, int kind, int index) {
+
+    if (TransitionsCount >= TransitionsSize) {
+        TransitionsSize += 64;
+        Transitions =
+            realloc (Transitions, TransitionsSize * sizeof(LightTransition));
     }
+    int position = TransitionsCount++;
+    while (position > 0) {
+        int parent = (position - 1) / 2;
+        if (Transitions[parent].when <= when) break;
+        Transitions[position] = Transitions[parent];
+        position = parent;
+    }
+    Transitions[position].when = when;
+    Transitions[position].kind = kind;
+    Transitions[position].index = index;
 }
 
-void houselights_schedule_periodic (time_t now) {
+static void houselights_schedule_pop (void) {
+
+    if (TransitionsCount <= 0) return;
+    LightTransition last = Transitions[--TransitionsCount];
+
+    int position = 0;
+    for (;;) {
+        int child = (2 * position) + 1;
+        if (child >= TransitionsCount) break;
+        if ((child + 1 < TransitionsCount) &&
+            (Transitions[child+1].when < Transitions[child].when)) child += 1;
+        if (last.when <= Transitions[child].when) break;
+        Transitions[position] = Transitions[child];
+        position = child;
+    }
+    Transitions[position] = last;
+}
+
+static void houselights_schedule_rule (int index, time_t now) {
 
-    static time_t LastCall = 0;
     int i;
+    char state = 'i';
+    LightSchedule *schedule = Schedules + index;
 
-    // Start scheduling even if there is no almanac data available.
-    // However any schedule that references almanac data will be ignored
-    // if none is available.
-    int ready = housealmanac_tonight_ready();
-    if (ScheduleDisabled) return;
+    for (i = 0; i < schedule->count; ++i) {
+        if ((now >= schedule->intervals[i].start) &&
+            (now < schedule->intervals[i].end)) {
+            state = 'a';
+            break;
+        }
+    }
+    if (schedule->state != state) {
+        schedule->state = state;
+        houselights_scheduleupdate ();
+    }
+}
+
+// If a plug is within an active window, maintain it on using a lease
+// that is renewed shortly before it expires, and that never goes
+// past the end of the window.
+// If no schedule is active for this plug, it will just switch
+// off on its own, when the last lease expires.
+// If this service stops for any reason, the lights will just go off
+// on their own after a few minutes.
+//
+static void houselights_schedule_evaluate (int index, time_t now) {
+
+    int i;
+    LightWindow *window = Windows + index;
+    time_t end = 0;
+
+    for (i = 0; i < window->count; ++i) {
+        if (now < window->intervals[i].start) break;
+        if (now < window->intervals[i].end) {
+            end = window->intervals[i].end;
+            break;
+        }
+    }
+    if (end) {
+        int duration = (int)(end - now);
+        houselights_plugs_lease (window->plug, duration, "SCHEDULE");
+        if (!window->active) {
+            houselog_event ("PLUG", window->plug, "ACTIVE",
+                            "SCHEDULED FOR %d MINUTES", (duration+30)/60);
+        }
+        window->active = end;
+        if (now + SCHEDULE_RENEW < end)
+            houselights_schedule_push (now + SCHEDULE_RENEW, SCHEDULE_WINDOW, index);
+    } else if (window->active) {
+        houselog_event ("PLUG", window->plug,
+                        "INACTIVE", "END OF SCHEDULE");
+        window->active = 0;
+    }
+}
+
+static void houselights_schedule_compile (time_t now) {
 
-    if (now < LastCall + 30) return; // Re-evaluate twice a minute.
-    LastCall = now;
+    int i, j, d;
+    LightDay days[4]; // Yesterday, today, tomorrow and the day after.
 
-    struct tm t = *localtime (&now);
-    int today = t.tm_wday;
-    t.tm_hour = t.tm_min = t.tm_sec = 0;
-    time_t base = mktime (&t);
+    TimelineValid = 0;
 
-    DEBUG ("============== Periodic check on day of week %d (mask 0x%x) at %s", today, (1 << today), ctime (&now));
+    houselights_schedule_calendar (days, 4, now, -1);
 
-    if ((now % 300) <= 30) { // Re-evaluate every 5 minutes.
+    // Draw a new random adjustment once a day only: the schedules are also
+    // recompiled on each change, which must not move the active windows.
+    if (days[1].midnight != LightsRandomDay) {
         struct timeval tv;
         gettimeofday (&tv, 0);
         LightsRandom = (tv.tv_usec % 600) - 300; // Range -5 to 5 minutes.
+        LightsRandomDay = days[1].midnight;
     }
 
-    time_t on;
-    time_t off;
+    DEBUG ("============== Compile schedules at %s", ctime (&now));
+
+    TransitionsCount = 0;
+    for (i = 0; i < WindowsCount; ++i) Windows[i].count = 0;
+
     for (i = 0 ; i < SchedulesCount; ++i) {
 
-        if (!Schedules[i].id) continue;
-        if (!Schedules[i].plug) continue;
+        LightSchedule *schedule = Schedules + i;
+        schedule->count = 0;
 
-        on = houselights_schedule_adjust (base, &(Schedules[i].on), ready);
-        off = houselights_schedule_adjust (base, &(Schedules[i].off), ready);
-        if ((on == 0) || (off == 0)) continue; // Cannot adjust this interval.
-
-        DEBUG ("Schedule for %s: on %s", Schedules[i].plug, ctime (&on));
-        DEBUG ("Schedule for %s: off %s", Schedules[i].plug, ctime (&off));
-        DEBUG ("Schedule for %s: days 0x%x", Schedules[i].plug, Schedules[i].days);
-        int duration = 0;
-
-        if (on < off) {
-            // Active from on to off today.
-            //
-            if (now >= on && now < off) {
-                if (Schedules[i].days & (1 << today)) {
-                    duration = (int)(off - now);
-                    DEBUG ("Activated (on <= now < off)\n");
-                    if (duration > 12*60*60) {
-                        // FIXME: the off time is for tomorrow.
-                        // An issue with which sunrise day is used.
-                        // Short term solution: fix the off reference.
-                        off -= 24*60*60;
-                        duration -= 24*60*60;
-                        if (now >= off) {
-                            DEBUG ("Cancel activation: off is tomorrow\n");
-                            duration = 0;
-                        }
-                    }
+        if (!schedule->id) continue;
+        if (!schedule->plug) continue;
+
+        for (d = 0; d < 3; ++d) {
+            LightInterval interval;
+            int found = houselights_schedule_occurrence (schedule, days + d, &interval);
+            if (!found) continue;
+            if (found > 1 && d == 1) // Once per day is enough.
+                houselog_trace (HOUSE_FAILURE, "TIME",
+                                "Duration over %dh for %s, limited",
+                                SCHEDULE_MAX_DURATION/(60*60), schedule->plug);
+            time_t on = interval.start;
+            time_t off = interval.end;
+            if (off <= now) continue; // Already over.
+
+            DEBUG ("Schedule for %s: on %s", schedule->plug, ctime (&on));
+            DEBUG ("Schedule for %s: off %s", schedule->plug, ctime (&off));
+
+            schedule->intervals[schedule->count].start = on;
+            schedule->intervals[schedule->count].end = off;
+            schedule->count += 1;
+
+            LightWindow *window = Windows + schedule->window;
+            if (window->count >= window->size) {
+                window->size += 4;
+                window->intervals =
+                    realloc (window->intervals, window->size * sizeof(LightInterval));
+            }
+            window->intervals[window->count].start = on;
+            window->intervals[window->count].end = off;
+            window->count += 1;
+        }
+    }
+
+    // Merge the overlapping intervals of each plug, and forget about
+    // the plugs that are no longer scheduled.
+    //
+    int kept = 0;
+    for (i = 0; i < WindowsCount; ++i) {
+        LightWindow *window = Windows + i;
+        if ((window->rulescount == 0) && (!window->active)) {
+            free (window->plug);
+            if (window->rules) free (window->rules);
+            if (window->intervals) free (window->intervals);
+            continue;
+        }
+        if (window->count > 1) {
+            qsort (window->intervals, window->count,
+                   sizeof(LightInterval), houselights_schedule_earlier);
+            int merged = 0;
+            for (j = 1; j < window->count; ++j) {
+                LightInterval *last = window->intervals + merged;
+                if (window->intervals[j].start <= last->end) {
+                    if (window->intervals[j].end > last->end)
+                        last->end = window->intervals[j].end;
+                } else {
+                    window->intervals[++merged] = window->intervals[j];
                 }
             }
-        } else {
-            houselog_trace (HOUSE_FAILURE, "TIME",
-                            "ON at %lld > OFF at %lld for %s",
-                            (long long)on, (long long)off, Schedules[i].plug);
-            continue; // Ignore this odd case.
+            window->count = merged + 1;
         }
+        if (kept != i) {
+            Windows[kept] = *window;
+            for (j = 0; j < Windows[kept].rulescount; ++j)
+                Schedules[Windows[kept].rules[j]].window = kept;
+        }
+        kept += 1;
+    }
+    if (kept != WindowsCount) {
+        WindowsCount = kept;
+        houselights_schedule_window_index ();
+    }
 
-        if (duration > 12*60*60) {
-            houselog_trace (HOUSE_FAILURE, "TIME", "Duration %d:%d for %s",
-                            duration/(60*60), (duration/60)%60,
-                            Schedules[i].plug);
-            continue; // Ignore when over 12h.
+    // Queue all the future transitions, and the next recompilation.
+    //
+    for (i = 0 ; i < SchedulesCount; ++i) {
+        for (j = 0; j < Schedules[i].count; ++j) {
+            LightInterval *interval = Schedules[i].intervals + j;
+            if (interval->start > now)
+                houselights_schedule_push (interval->start, SCHEDULE_RULE, i);
+            houselights_schedule_push (interval->end, SCHEDULE_RULE, i);
+        }
+    }
+    for (i = 0; i < WindowsCount; ++i) {
+        for (j = 0; j < Windows[i].count; ++j) {
+            LightInterval *interval = Windows[i].intervals + j;
+            if (interval->start > now)
+                houselights_schedule_push (interval->start, SCHEDULE_WINDOW, i);
+            houselights_schedule_push (interval->end, SCHEDULE_WINDOW, i);
         }
+    }
+    houselights_schedule_push (days[2].midnight, SCHEDULE_COMPILE, 0);
 
-        // If the schedule is active, maintain the plugs on until the next
-        // evaluation (plus a 10 seconds grace period to avoid flickering).
-        // If no schedule is active for this plug, it will just switch
-        // off on its own, when the last pulse expires.
-        // If this service stops for any reason, the lights will just go off
-        // on their own after less than a minute.
-        //
-        if (duration > 0) {
-            houselights_plugs_on (Schedules[i].plug, 40, 0, "SCHEDULE");
-            if (Schedules[i].state != 'a') {
-                houselog_event ("PLUG", Schedules[i].plug, "ACTIVE",
-                                "SCHEDULED FOR %d MINUTES", (duration+30)/60);
-                Schedules[i].state = 'a';
-            }
-        } else {
-            if (Schedules[i].state != 'i') {
-                houselog_event ("PLUG", Schedules[i].plug,
-                                "INACTIVE", "END OF SCHEDULE");
-                Schedules[i].state = 'i';
-            }
+    CompiledSunset = ScheduleReady ? housealmanac_tonight_sunset() : 0;
+    CompiledSunrise = ScheduleReady ? housealmanac_tonight_sunrise() : 0;
+    ScheduleCompiled = 1;
+
+    // Apply the current state right away.
+    for (i = 0 ; i < SchedulesCount; ++i) houselights_schedule_rule (i, now);
+    for (i = 0; i < WindowsCount; ++i) houselights_schedule_evaluate (i, now);
+}
+
+void houselights_schedule_periodic (time_t now) {
+
+    // Start scheduling even if there is no almanac data available.
+    // However any schedule that references almanac data will be ignored
+    // if none is available.
+    if (ScheduleDisabled) return;
+
+    int ready = housealmanac_tonight_ready();
+    if ((!ScheduleCompiled) ||
+        (CompiledSunset != (ready ? housealmanac_tonight_sunset() : 0)) ||
+        (CompiledSunrise != (ready ? housealmanac_tonight_sunrise() : 0))) {
+        houselights_schedule_compile (now);
+    }
+
+    while ((TransitionsCount > 0) && (Transitions[0].when <= now)) {
+        LightTransition transition = Transitions[0];
+        houselights_schedule_pop ();
+        switch (transition.kind) {
+            case SCHEDULE_RULE:
+                houselights_schedule_rule (transition.index, now);
+                break;
+            case SCHEDULE_WINDOW:
+                houselights_schedule_evaluate (transition.index, now);
+                break;
+            case SCHEDULE_COMPILE:
+                houselights_schedule_compile (now);
+                break;
         }
     }
 }
 
-int houselights_schedule_status (char *buffer, int size) {
+void houselights_schedule_status (LightsOutput *out) {
 
     int i;
-    int cursor = 0;
     const char *prefix = "";
 
-    cursor += snprintf (buffer+cursor, size-cursor,
-                        "\"mode\":\"%s\",\"schedules\":[",
-                        ScheduleDisabled?"manual":"auto");
-    if (cursor >= size) goto overflow;
+    houselights_output_format (out, "\"mode\":\"%s\",\"schedules\":[",
+                               ScheduleDisabled?"manual":"auto");
 
     for (i = 0; i < SchedulesCount; ++i) {
 
@@ -356,28 +1081,124 @@ int houselights_schedule_status (char *buffer, int size) {
         on[0] = Schedules[i].on.base;
         off[0] = Schedules[i].off.base;
         on[1] = off[1] = 0;
-        cursor += snprintf (buffer+cursor, size-cursor,
-                            "%s{\"id\":%d,\"device\":\"%s\",\"state\":\"%c\""
-                                ",\"on\":\"%s%02d:%02d\""
-                                ",\"off\":\"%s%02d:%02d\""
-                                ",\"days\":%d}",
-                            prefix, Schedules[i].id,
-                            Schedules[i].plug, Schedules[i].state,
-                            on, Schedules[i].on.hour, Schedules[i].on.minutes,
-                            off, Schedules[i].off.hour, Schedules[i].off.minutes,
-                            Schedules[i].days);
-        if (cursor >= size) goto overflow;
+        houselights_output_format (out,
+                                   "%s{\"id\":%d,\"device\":\"%s\",\"state\":\"%c\""
+                                       ",\"on\":\"%s%02d:%02d\""
+                                       ",\"off\":\"%s%02d:%02d\""
+                                       ",\"days\":%d}",
+                                   prefix, Schedules[i].id,
+                                   Schedules[i].plug, Schedules[i].state,
+                                   on, Schedules[i].on.hour, Schedules[i].on.minutes,
+                                   off, Schedules[i].off.hour, Schedules[i].off.minutes,
+                                   Schedules[i].days);
         prefix = ",";
     }
+    houselights_output_append (out, "]");
+}
 
-    cursor += snprintf (buffer+cursor, size-cursor, "]");
-    if (cursor >= size) goto overflow;
+void houselights_schedule_timeline (LightsOutput *out, int days, time_t now) {
 
-    return cursor;
+    int i, j, k, d;
 
-overflow:
-    houselog_trace (HOUSE_FAILURE, "BUFFER", "overflow");
-    buffer[0] = 0;
-    return 0;
+    if (days < 1) days = 1;
+    if (days > TIMELINE_MAX_DAYS) days = TIMELINE_MAX_DAYS;
+
+    if ((!ScheduleCompiled) || (!TimelineValid) || (days != TimelineDays)) {
+
+        // Start the expansion from yesterday, so that the intervals still
+        // active since last night are included, and then clip the output
+        // to the requested days.
+        LightDay *calendar = calloc (days + 2, sizeof(LightDay));
+        houselights_schedule_calendar (calendar, days + 2, now, -1);
+        time_t start = calendar[1].midnight;
+        time_t end = calendar[days+1].midnight;
+
+        houselights_output_reset (&Timeline);
+        houselights_output_format (&Timeline,
+                                   "\"timeline\":{\"start\":%lld,\"days\":%d,"
+                                       "\"plugs\":[",
+                                   (long long)start, days);
+
+        // Use the per-plug index: each plug is expanded, sorted and merged
+        // on its own, which keeps the sort small.
+        const char *prefix = "";
+        for (i = 0; i < WindowsCount; ++i) {
+            LightWindow *window = Windows + i;
+            if (window->rulescount <= 0) continue;
+
+            int needed = window->rulescount * (days + 1);
+            if (needed > TimelineSize) {
+                TimelineSize = needed + 256;
+                TimelineIntervals =
+                    realloc (TimelineIntervals, TimelineSize * sizeof(LightInterval));
+            }
+            int count = 0;
+            for (j = 0; j < window->rulescount; ++j) {
+                LightSchedule *schedule = Schedules + window->rules[j];
+                for (d = 0; d <= days; ++d) {
+                    if (houselights_schedule_occurrence
+                            (schedule, calendar + d, TimelineIntervals + count) > 0)
+                        count += 1;
+                }
+            }
+            if (count <= 0) continue;
+
+            if (window->rulescount > 1)
+                qsort (TimelineIntervals, count,
+                       sizeof(LightInterval), houselights_schedule_earlier);
+
+            LightInterval last = TimelineIntervals[0];
+            const char *separator = 0;
+            for (k = 1; k <= count; ++k) {
+                if ((k < count) && (TimelineIntervals[k].start <= last.end)) {
+                    if (TimelineIntervals[k].end > last.end)
+                        last.end = TimelineIntervals[k].end;
+                    continue;
+                }
+                if (last.start < start) last.start = start;
+                if (last.end > end) last.end = end;
+                if (last.start < last.end) {
+                    if (!separator) {
+                        houselights_output_format
+                            (&Timeline, "%s{\"device\":\"%s\",\"intervals\":[",
+                             prefix, window->plug);
+                        separator = "";
+                    }
+                    houselights_output_format (&Timeline, "%s[%lld,%lld]", separator,
+                                               (long long)(last.start),
+                                               (long long)(last.end));
+                    separator = ",";
+                }
+                if (k < count) last = TimelineIntervals[k];
+            }
+            if (separator) {
+                houselights_output_append (&Timeline, "]}");
+                prefix = ",";
+            }
+        }
+        houselights_output_append (&Timeline, "]}");
+        free (calendar);
+
+        TimelineDays = days;
+        TimelineValid = 1;
+    }
+    houselights_output_append (out, Timeline.data);
 }
 
+void houselights_schedule_metrics (LightsOutput *out) {
+
+    int i;
+    int count = 0;
+    int active = 0;
+
+    for (i = 0; i < SchedulesCount; ++i) {
+        if (Schedules[i].id && Schedules[i].plug) count += 1;
+    }
+    for (i = 0; i < WindowsCount; ++i) {
+        if (Windows[i].active) active += 1;
+    }
+    houselights_output_format (out,
+                               "\"schedules\":{\"count\":%d,\"windows\":%d,"
+                                   "\"active\":%d,\"transitions\":%d}",
+                               count, WindowsCount, active, TransitionsCount);
+}
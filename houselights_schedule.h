@@ -31,7 +31,11 @@ void houselights_schedule_add (const char *plug,
 
 void houselights_schedule_delete (const char *id);
 
+const char *houselights_schedule_bulk (const char *action, const char *data);
+
 void houselights_schedule_periodic (time_t now);
 
-int houselights_schedule_status (char *buffer, int size);
+void houselights_schedule_status (LightsOutput *out);
+void houselights_schedule_timeline (LightsOutput *out, int days, time_t now);
+void houselights_schedule_metrics (LightsOutput *out);
 
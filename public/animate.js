@@ -60,11 +60,12 @@ function lightsControlClick (id) {
 
 function lightsStatus () {
     var url = RootUrl+"/status";
-    if (LightsLatestStatus) url += "?known=" + LightsLatestStatus;
+    if (LightsLatestStatus) url += "?delta=1&known=" + LightsLatestStatus;
     var command = new XMLHttpRequest();
     command.open("GET", url);
     command.onreadystatechange = function () {
-        if (command.readyState === 4 && command.status === 200) {
+        if (command.readyState !== 4) return;
+        if (command.status === 200 && command.responseText) {
             var response = JSON.parse(command.responseText);
             lightsUpdateStatus (response);
         }
@@ -74,7 +75,6 @@ function lightsStatus () {
 
 function animateStart (path) {
    RootUrl = path;
-   lightsStatus();
-   setInterval (lightsStatus, 1000);
+   lightsPollStart (lightsStatus);
 }
 
@@ -0,0 +1,39 @@
+// Request the status of the lights every second, as long as the page is
+// visible. The pages pass the last known status version to the server,
+// which returns an empty response if nothing changed: polling every second
+// is cheap, and a change made on one panel shows on the others within
+// one second.
+//
+// The server cannot push the changes (no long poll, no server-sent events):
+// the echttp request handlers must return their complete response before
+// the server processes the next request, and there is no way to defer
+// a response. Holding a status request until a change would block the
+// whole service.
+//
+// lightsPollStart (request)
+//
+//    Call the request function now, and then every second. The polling
+//    stops when the page is hidden and resumes, with an immediate request,
+//    when the page is visible again.
+//
+var LightsPollTimer = null;
+var LightsPollRequest = null;
+
+function lightsPollTick () {
+    LightsPollTimer = null;
+    if (document.hidden) return;
+    LightsPollTimer = setTimeout (lightsPollTick, 1000);
+    LightsPollRequest();
+}
+
+function lightsPollVisibility () {
+    if (LightsPollTimer) clearTimeout (LightsPollTimer);
+    LightsPollTimer = null;
+    if (!document.hidden) lightsPollTick();
+}
+
+function lightsPollStart (request) {
+    LightsPollRequest = request;
+    document.addEventListener ("visibilitychange", lightsPollVisibility);
+    lightsPollTick();
+}